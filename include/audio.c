@@ -0,0 +1,516 @@
+#include <defines.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "rt_check.c"
+#include "tsf.h"
+
+/* Note events travel from the main thread to the audio callback through a
+ * single producer, single consumer ring.  tsf keeps its playing voices in a
+ * list that only the rendering thread may change, so the main thread never
+ * calls tsf_note_* itself: it pushes commands here and the callback applies
+ * them right before rendering each buffer.  */
+
+#define NOTE_QUEUE_SIZE 1024 /* must be a power of two */
+#define NOTE_QUEUE_CHANNELS 16
+#define DRUM_CHANNEL 9
+
+typedef enum
+{
+  NOTE_COMMAND_ON,
+  NOTE_COMMAND_OFF,
+} NoteCommandType;
+
+typedef struct
+{
+  uint8_t type;
+  uint8_t channel;
+  uint8_t program;
+  uint8_t key;
+  float velocity;
+} NoteCommand;
+
+typedef struct
+{
+  NoteCommand commands[NOTE_QUEUE_SIZE];
+  _Atomic uint32_t head; /* next slot to write, owned by the main thread */
+  _Atomic uint32_t tail; /* next slot to read, owned by the audio thread */
+  /* Note offs that found the queue full, kept by the main thread and sent
+     before any other command so that no note is left sounding.  */
+  uint64_t pending_off[NOTE_QUEUE_CHANNELS][2];
+  uint8_t pending_program[NOTE_QUEUE_CHANNELS][128];
+  int pending_count;
+} NoteQueue;
+
+/* Returns false when the queue is full and the command was dropped.  */
+bool
+note_queue_push (NoteQueue *queue, NoteCommand command)
+{
+  uint32_t head = atomic_load_explicit (&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit (&queue->tail, memory_order_acquire);
+  if (head - tail == NOTE_QUEUE_SIZE)
+    {
+      return false;
+    }
+  queue->commands[head & (NOTE_QUEUE_SIZE - 1)] = command;
+  atomic_store_explicit (&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+static bool
+note_queue_pending (NoteQueue *queue, int channel, int key)
+{
+  return (queue->pending_off[channel][key >> 6] >> (key & 63)) & 1;
+}
+
+/* Send the note offs that were kept back, call this once per frame.
+ * Returns false when some are still waiting for room.  */
+bool
+note_queue_flush (NoteQueue *queue)
+{
+  for (int channel = 0;
+       channel < NOTE_QUEUE_CHANNELS && queue->pending_count > 0; channel++)
+    {
+      for (int key = 0; key < 128; key++)
+        {
+          if (!note_queue_pending (queue, channel, key))
+            {
+              continue;
+            }
+          NoteCommand command
+              = { NOTE_COMMAND_OFF, channel,
+                  queue->pending_program[channel][key], key, 0.0f };
+          if (!note_queue_push (queue, command))
+            {
+              return false;
+            }
+          queue->pending_off[channel][key >> 6]
+              &= ~((uint64_t)1 << (key & 63));
+          queue->pending_count--;
+        }
+    }
+  return true;
+}
+
+/* Returns false when the note was dropped, because the queue is full or
+ * a note off of the same key is still waiting.  */
+bool
+note_queue_note_on (NoteQueue *queue, int channel, int program, int key,
+                    float velocity)
+{
+  NoteCommand command = { NOTE_COMMAND_ON, channel, program, key, velocity };
+  if (!note_queue_flush (queue) && note_queue_pending (queue, channel, key))
+    {
+      return false;
+    }
+  return note_queue_push (queue, command);
+}
+
+/* Note offs are never dropped: when the queue is full they wait for
+ * note_queue_flush.  Returns false in that case.  */
+bool
+note_queue_note_off (NoteQueue *queue, int channel, int program, int key)
+{
+  NoteCommand command = { NOTE_COMMAND_OFF, channel, program, key, 0.0f };
+  if (note_queue_flush (queue) && note_queue_push (queue, command))
+    {
+      return true;
+    }
+  if (!note_queue_pending (queue, channel, key))
+    {
+      queue->pending_off[channel][key >> 6] |= (uint64_t)1 << (key & 63);
+      queue->pending_count++;
+    }
+  queue->pending_program[channel][key] = program;
+  return false;
+}
+
+/* Apply every queued command to SF, call this on the audio thread only.
+ * Drums on channel 9 play the bank 128 kit, everything else bank 0.  */
+void
+note_queue_apply (NoteQueue *queue, tsf *sf)
+{
+  uint32_t tail = atomic_load_explicit (&queue->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit (&queue->head, memory_order_acquire);
+  for (; tail != head; tail++)
+    {
+      NoteCommand command = queue->commands[tail & (NOTE_QUEUE_SIZE - 1)];
+      int bank = command.channel == DRUM_CHANNEL ? 128 : 0;
+      int program = command.channel == DRUM_CHANNEL ? 0 : command.program;
+      if (command.type == NOTE_COMMAND_ON)
+        {
+          tsf_set_note_bus (sf, command.channel);
+          tsf_bank_note_on (sf, bank, program, command.key, command.velocity);
+        }
+      else
+        {
+          tsf_bank_note_off (sf, bank, program, command.key);
+        }
+    }
+  atomic_store_explicit (&queue->tail, tail, memory_order_release);
+}
+
+/* Voices can also render on a pool of worker threads.  tsf splits the
+ * playing voices into RENDER_GROUPS fixed groups, each thread renders its
+ * share of the groups into their own buffers and the callback adds the
+ * buffers up in group order, so the output is the same for any number of
+ * threads.  The calling thread renders the first share itself.  */
+
+#define RENDER_GROUPS 8
+#define RENDER_POOL_FRAMES 4096 /* longest slice rendered at once */
+
+typedef struct RenderPool RenderPool;
+
+typedef struct
+{
+  RenderPool *pool;
+  pthread_t thread;
+  sem_t start;
+  int index;
+} RenderWorker;
+
+struct RenderPool
+{
+  tsf *sf;
+  int thread_count; /* including the calling thread */
+  int frames;
+  atomic_bool running;
+  sem_t done;
+  RenderWorker workers[RENDER_GROUPS];
+  float buffers[RENDER_GROUPS][RENDER_POOL_FRAMES * CHANNELS];
+};
+
+static void
+render_pool_run (RenderPool *pool, int index)
+{
+  for (int group = index; group < RENDER_GROUPS; group += pool->thread_count)
+    {
+      tsf_render_float_group (pool->sf, group, RENDER_GROUPS,
+                              pool->buffers[group], pool->frames, 0);
+    }
+}
+
+static void *
+render_worker (void *arg)
+{
+  RenderWorker *worker = arg;
+  RenderPool *pool = worker->pool;
+  for (;;)
+    {
+      sem_wait (&worker->start);
+      if (!atomic_load (&pool->running))
+        {
+          return NULL;
+        }
+      RT_CHECK_ENTER ();
+      render_pool_run (pool, worker->index);
+      RT_CHECK_LEAVE ();
+      sem_post (&pool->done);
+    }
+}
+
+/* Start THREAD_COUNT - 1 workers, each pinned to its own core when the
+ * system allows it.  Returns false when no worker could be started.  */
+bool
+render_pool_start (RenderPool *pool, tsf *sf, int thread_count)
+{
+  if (thread_count > RENDER_GROUPS)
+    {
+      thread_count = RENDER_GROUPS;
+    }
+  pool->sf = sf;
+  pool->thread_count = 1;
+  atomic_store (&pool->running, true);
+  if (sem_init (&pool->done, 0, 0) != 0)
+    {
+      return false;
+    }
+  for (int i = 1; i < thread_count; i++)
+    {
+      RenderWorker *worker = &pool->workers[i];
+      worker->pool = pool;
+      worker->index = i;
+      if (sem_init (&worker->start, 0, 0) != 0)
+        {
+          break;
+        }
+      if (pthread_create (&worker->thread, NULL, render_worker, worker) != 0)
+        {
+          sem_destroy (&worker->start);
+          break;
+        }
+#ifdef __linux__
+      long cores = sysconf (_SC_NPROCESSORS_ONLN);
+      if (cores > 1)
+        {
+          cpu_set_t set;
+          CPU_ZERO (&set);
+          CPU_SET (i % cores, &set);
+          pthread_setaffinity_np (worker->thread, sizeof (set), &set);
+        }
+#endif
+      pool->thread_count++;
+    }
+  return pool->thread_count > 1;
+}
+
+void
+render_pool_stop (RenderPool *pool)
+{
+  atomic_store (&pool->running, false);
+  for (int i = 1; i < pool->thread_count; i++)
+    {
+      sem_post (&pool->workers[i].start);
+      pthread_join (pool->workers[i].thread, NULL);
+      sem_destroy (&pool->workers[i].start);
+    }
+  sem_destroy (&pool->done);
+  pool->thread_count = 1;
+}
+
+/* Render FRAMES stereo frames into OUT, call this on the audio thread
+ * after note_queue_apply.  Without playing voices there is nothing to
+ * wake the workers for.  */
+void
+render_pool_render (RenderPool *pool, float *out, unsigned int frames)
+{
+  if (tsf_active_voice_count (pool->sf) == 0)
+    {
+      memset (out, 0, frames * CHANNELS * sizeof (float));
+      return;
+    }
+  while (frames > 0)
+    {
+      int count = frames < RENDER_POOL_FRAMES ? frames : RENDER_POOL_FRAMES;
+      pool->frames = count;
+      for (int i = 1; i < pool->thread_count; i++)
+        {
+          sem_post (&pool->workers[i].start);
+        }
+      render_pool_run (pool, 0);
+      for (int i = 1; i < pool->thread_count; i++)
+        {
+          RT_CHECK_EXEMPT (sem_wait (&pool->done));
+        }
+      tsf_render_groups_finish (pool->sf);
+      for (int i = 0; i < count * CHANNELS; i++)
+        {
+          float sum = pool->buffers[0][i];
+          for (int group = 1; group < RENDER_GROUPS; group++)
+            {
+              sum += pool->buffers[group][i];
+            }
+          out[i] = sum;
+        }
+      out += count * CHANNELS;
+      frames -= count;
+    }
+}
+
+/* The governor keeps rendering inside the callback deadline on slow
+ * machines.  Every callback reports how long rendering took next to how
+ * long its buffer plays.  When the smoothed ratio gets high the governor
+ * steps one quality level down, when it stayed low for a while it steps
+ * back up.  Level 0 renders with the interpolation given to
+ * governor_init and no voice limit, level 1 switches to linear
+ * interpolation and ends quiet voice tails earlier, and every further
+ * level plays fewer voices.  The counters can be read from any thread.  */
+
+#define GOVERNOR_HIGH_LOAD 0.7
+#define GOVERNOR_LOW_LOAD 0.35
+#define GOVERNOR_SMOOTHING 0.2
+#define GOVERNOR_COOLDOWN 8   /* callbacks between two steps down */
+#define GOVERNOR_RESTORE 200  /* calm callbacks before a step up */
+#define GOVERNOR_CULL_DB -90.0f /* voices quieter than this end */
+#define GOVERNOR_PRESSURE_CULL_DB -60.0f /* the same from level 1 on */
+
+static const int governor_voice_limits[] = { 0, 0, 96, 64, 48, 32 };
+#define GOVERNOR_LEVELS                                                       \
+  (int)(sizeof (governor_voice_limits) / sizeof (governor_voice_limits[0]))
+
+typedef struct
+{
+  _Atomic uint64_t callbacks;
+  _Atomic uint64_t overruns; /* rendering took longer than the buffer */
+  _Atomic uint64_t interpolation_lowered;
+  _Atomic uint64_t interpolation_restored;
+  _Atomic uint64_t voice_limit_lowered;
+  _Atomic uint64_t voice_limit_raised;
+  _Atomic int level;
+  _Atomic int voice_limit;
+  _Atomic float load; /* smoothed render time / buffer time */
+} GovernorCounters;
+
+typedef struct
+{
+  tsf *sf;
+  _Atomic (tsf *) follow; /* second instance of governor_follow */
+  tsf *followed;          /* the one the level was applied to */
+  enum TSFInterpolation interpolation;
+  double load;
+  int level;
+  int cooldown;
+  int calm;
+  GovernorCounters counters;
+} Governor;
+
+/* Runs in the callback, so it only switches to the sinc table that
+ * governor_init created, and that tsf_copy gives the copies of SF.  */
+static void
+governor_apply_to (Governor *governor, tsf *sf)
+{
+  tsf_switch_interpolation (sf, governor->level == 0
+                                    ? governor->interpolation
+                                    : TSF_INTERPOLATION_LINEAR);
+  tsf_set_voice_limit (sf, governor_voice_limits[governor->level]);
+  tsf_set_cull_threshold (sf, governor->level == 0
+                                  ? GOVERNOR_CULL_DB
+                                  : GOVERNOR_PRESSURE_CULL_DB);
+}
+
+static void
+governor_apply (Governor *governor)
+{
+  int limit = governor_voice_limits[governor->level];
+  governor_apply_to (governor, governor->sf);
+  if (governor->followed != NULL)
+    {
+      governor_apply_to (governor, governor->followed);
+    }
+  atomic_store_explicit (&governor->counters.level, governor->level,
+                         memory_order_relaxed);
+  atomic_store_explicit (&governor->counters.voice_limit, limit,
+                         memory_order_relaxed);
+}
+
+/* Returns false when the interpolation tables could not be allocated,
+ * the governor then starts from linear interpolation.  */
+bool
+governor_init (Governor *governor, tsf *sf,
+               enum TSFInterpolation interpolation)
+{
+  memset (governor, 0, sizeof (*governor));
+  governor->sf = sf;
+  governor->interpolation = interpolation;
+  bool ok = tsf_set_interpolation (sf, interpolation);
+  if (!ok)
+    {
+      governor->interpolation = TSF_INTERPOLATION_LINEAR;
+    }
+  governor_apply (governor);
+  return ok;
+}
+
+/* Also control SF from the next governor_update on, for example another
+ * instance the callback renders, or stop with NULL.  Call this once no
+ * other thread renders SF.  Each instance gets the same voice limit.  */
+void
+governor_follow (Governor *governor, tsf *sf)
+{
+  atomic_store_explicit (&governor->follow, sf, memory_order_release);
+}
+
+/* Call this on the audio thread after each callback rendered.  */
+void
+governor_update (Governor *governor, double render_seconds,
+                 double buffer_seconds)
+{
+  GovernorCounters *counters = &governor->counters;
+  double load = render_seconds / buffer_seconds;
+  int previous = governor->level;
+  tsf *follow = atomic_load_explicit (&governor->follow, memory_order_acquire);
+  if (follow != governor->followed)
+    {
+      governor->followed = follow;
+      if (follow != NULL)
+        {
+          governor_apply_to (governor, follow);
+        }
+    }
+  atomic_fetch_add_explicit (&counters->callbacks, 1, memory_order_relaxed);
+  if (load > 1.0)
+    {
+      atomic_fetch_add_explicit (&counters->overruns, 1,
+                                 memory_order_relaxed);
+    }
+  governor->load += (load - governor->load) * GOVERNOR_SMOOTHING;
+  atomic_store_explicit (&counters->load, (float)governor->load,
+                         memory_order_relaxed);
+  if (governor->cooldown > 0)
+    {
+      governor->cooldown--;
+    }
+
+  if ((governor->load > GOVERNOR_HIGH_LOAD || load > 1.0)
+      && governor->cooldown == 0 && governor->level < GOVERNOR_LEVELS - 1)
+    {
+      governor->level++;
+      governor->cooldown = GOVERNOR_COOLDOWN;
+      governor->calm = 0;
+    }
+  else if (governor->load < GOVERNOR_LOW_LOAD)
+    {
+      if (++governor->calm >= GOVERNOR_RESTORE && governor->level > 0)
+        {
+          governor->level--;
+          governor->calm = 0;
+        }
+    }
+  else
+    {
+      governor->calm = 0;
+    }
+  if (governor->level == previous)
+    {
+      return;
+    }
+
+  if (governor->level == 1 && previous == 0)
+    {
+      atomic_fetch_add_explicit (&counters->interpolation_lowered, 1,
+                                 memory_order_relaxed);
+    }
+  else if (governor->level == 0)
+    {
+      atomic_fetch_add_explicit (&counters->interpolation_restored, 1,
+                                 memory_order_relaxed);
+    }
+  else if (governor->level > previous)
+    {
+      atomic_fetch_add_explicit (&counters->voice_limit_lowered, 1,
+                                 memory_order_relaxed);
+    }
+  else
+    {
+      atomic_fetch_add_explicit (&counters->voice_limit_raised, 1,
+                                 memory_order_relaxed);
+    }
+  governor_apply (governor);
+}
+
+void
+governor_print (Governor *governor, FILE *out)
+{
+  GovernorCounters *counters = &governor->counters;
+  fprintf (out,
+           "governor: %llu callbacks, %llu overruns, load %.2f, level %d "
+           "(voice limit %d)\n"
+           "  interpolation lowered %llu, restored %llu\n"
+           "  voice limit lowered %llu, raised %llu\n"
+           "  quiet voices ended %u\n",
+           (unsigned long long)atomic_load (&counters->callbacks),
+           (unsigned long long)atomic_load (&counters->overruns),
+           atomic_load (&counters->load), atomic_load (&counters->level),
+           atomic_load (&counters->voice_limit),
+           (unsigned long long)atomic_load (&counters->interpolation_lowered),
+           (unsigned long long)atomic_load (
+               &counters->interpolation_restored),
+           (unsigned long long)atomic_load (&counters->voice_limit_lowered),
+           (unsigned long long)atomic_load (&counters->voice_limit_raised),
+           tsf_get_culled_voices (governor->sf));
+}
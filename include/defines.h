@@ -2,4 +2,18 @@
 #define DEFINES_H
 #define SAMPLE_RATE 44100
 #define CHANNELS 2
+/* Velocity given to tsf for a MIDI velocity, the same on every path */
+#define MIDI_VELOCITY(velocity) ((float)(velocity) / 127.0f)
+/* More than one renders the synthesizer voices on a pool of threads */
+#define RENDER_THREADS 1
+/* Nonzero asks for real-time scheduling and locks the soundfont in RAM */
+#define REALTIME_AUDIO 1
+/* Memory kept for rendered exercise snippets */
+#define SNIPPET_CACHE_MB 32
+/* Interval keys play from notes rendered once at startup: 0 never,
+   1 always, 2 once the governor kept a reduced quality level for a while */
+#define SAMPLED_INSTRUMENTS 2
+/* Nonzero renders each MIDI channel apart and shows its level, the song
+   then renders in the callback instead of ahead of it */
+#define CHANNEL_METERS 0
 #endif
@@ -0,0 +1,140 @@
+#include <defines.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include "tsf.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/* Level meters per MIDI channel, see CHANNEL_METERS in defines.h.  The
+ * callback renders with tsf_render_float_buses, every channel into its
+ * own submix bus, and measures the peak and RMS of each bus.  The levels
+ * of the last buffer are published through a sequence lock: the callback
+ * never waits, the main thread retries the rare read that overlapped a
+ * write.  Without CHANNEL_METERS none of this runs.  */
+
+#define METER_BUSES 16     /* one per MIDI channel */
+#define METER_FRAMES 1024  /* longest slice rendered at once */
+#define METER_FLOOR_DB -60 /* levels below show as silence */
+
+typedef struct
+{
+  float peak[METER_BUSES]; /* largest absolute sample */
+  float rms[METER_BUSES];
+} MeterLevels;
+
+typedef struct
+{
+  float buses[METER_BUSES * METER_FRAMES * CHANNELS];
+  _Atomic uint32_t sequence; /* odd while the callback writes */
+  _Atomic float peak[METER_BUSES];
+  _Atomic float rms[METER_BUSES];
+} Meters;
+
+/* Raise *PEAK to the largest absolute value of the COUNT SAMPLES and
+ * return the sum of their squares.  */
+static float
+meter_scan (const float *samples, int count, float *peak)
+{
+  int i = 0;
+  float largest = *peak;
+  float sum = 0.0f;
+#ifdef __SSE__
+  const __m128 sign = _mm_set1_ps (-0.0f);
+  __m128 largest4 = _mm_set1_ps (largest);
+  __m128 sum4 = _mm_setzero_ps ();
+  for (; i + 4 <= count; i += 4)
+    {
+      __m128 x = _mm_loadu_ps (samples + i);
+      largest4 = _mm_max_ps (largest4, _mm_andnot_ps (sign, x));
+      sum4 = _mm_add_ps (sum4, _mm_mul_ps (x, x));
+    }
+  float lanes[4];
+  _mm_storeu_ps (lanes, largest4);
+  for (int lane = 0; lane < 4; lane++)
+    {
+      largest = lanes[lane] > largest ? lanes[lane] : largest;
+    }
+  _mm_storeu_ps (lanes, sum4);
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+  for (; i < count; i++)
+    {
+      float x = fabsf (samples[i]);
+      largest = x > largest ? x : largest;
+      sum += x * x;
+    }
+  *peak = largest;
+  return sum;
+}
+
+/* Render FRAMES of SF into OUT like tsf_render_float, with the voices of
+ * channel c kept apart on bus c, and publish the levels of each bus.  Call
+ * from the audio callback.  */
+void
+meters_render (Meters *meters, tsf *sf, float *out, unsigned int frames)
+{
+  float peak[METER_BUSES] = { 0 };
+  double square[METER_BUSES] = { 0 };
+  for (unsigned int done = 0; done < frames;)
+    {
+      int count = frames - done < METER_FRAMES ? frames - done : METER_FRAMES;
+      tsf_render_float_buses (sf, out + done * CHANNELS, meters->buses,
+                              METER_BUSES, count, 0);
+      for (int bus = 0; bus < METER_BUSES; bus++)
+        {
+          square[bus] += meter_scan (meters->buses + bus * count * CHANNELS,
+                                     count * CHANNELS, &peak[bus]);
+        }
+      done += count;
+    }
+  uint32_t sequence
+      = atomic_load_explicit (&meters->sequence, memory_order_relaxed);
+  atomic_store_explicit (&meters->sequence, sequence + 1,
+                         memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  for (int bus = 0; bus < METER_BUSES; bus++)
+    {
+      float rms = frames ? sqrt (square[bus] / (frames * CHANNELS)) : 0;
+      atomic_store_explicit (&meters->peak[bus], peak[bus],
+                             memory_order_relaxed);
+      atomic_store_explicit (&meters->rms[bus], rms, memory_order_relaxed);
+    }
+  atomic_store_explicit (&meters->sequence, sequence + 2,
+                         memory_order_release);
+}
+
+/* Copy the levels of the last rendered buffer, from the main thread.  */
+void
+meters_read (Meters *meters, MeterLevels *levels)
+{
+  uint32_t before, after;
+  do
+    {
+      before = atomic_load_explicit (&meters->sequence, memory_order_acquire);
+      for (int bus = 0; bus < METER_BUSES; bus++)
+        {
+          levels->peak[bus] = atomic_load_explicit (&meters->peak[bus],
+                                                    memory_order_relaxed);
+          levels->rms[bus] = atomic_load_explicit (&meters->rms[bus],
+                                                   memory_order_relaxed);
+        }
+      atomic_thread_fence (memory_order_acquire);
+      after = atomic_load_explicit (&meters->sequence, memory_order_relaxed);
+    }
+  while ((before & 1) || before != after);
+}
+
+/* Fraction 0 to 1 of a meter bar showing LEVEL on a decibel scale.  */
+float
+meter_fraction (float level)
+{
+  if (level <= 0)
+    {
+      return 0;
+    }
+  float db = 20 * log10f (level);
+  return db < METER_FLOOR_DB ? 0 : db > 0 ? 1 : 1 - db / METER_FLOOR_DB;
+}
@@ -13,8 +13,6 @@
 #define PADDING 50
 #define MAX_PLAYING_SOUND 32
 #define NUM_SEMITONES 36
-#define BASS_INDEX 28
-#define GUITAR_INDEX 60
 
 /* The structure of the midi data structure there will be a hash map the key of
  * the hash map corresponds to the delta time of an event the value of the hash
@@ -27,14 +25,6 @@
 
 //
 
-typedef struct
-{
-  Sound sound;
-  bool free;
-  float playing_time; // seconds
-  float volume;
-} ReleaseSound;
-
 typedef uint32_t u32;
 typedef uint64_t u64;
 typedef uint16_t u16;
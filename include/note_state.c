@@ -0,0 +1,97 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* The notes sounding on each MIDI channel, for the visualizer.  Whoever
+ * dispatches the song (the main loop today, the audio thread later)
+ * changes its own working copy and publishes it once per block through a
+ * triple buffer: publishing and reading only exchange buffer indices, so
+ * neither side waits and the reader always sees a whole block.  */
+
+#define NOTE_STATE_CHANNELS 16
+#define NOTE_STATE_KEYS 128
+
+typedef struct
+{
+  uint64_t playing[NOTE_STATE_CHANNELS][NOTE_STATE_KEYS / 64]; /* bitmap */
+  uint8_t velocity[NOTE_STATE_CHANNELS][NOTE_STATE_KEYS];
+  uint32_t onset[NOTE_STATE_CHANNELS][NOTE_STATE_KEYS]; /* tick of note on */
+} NoteSnapshot;
+
+#define NOTE_STATE_FRESH 4u /* set in spare when it holds a newer block */
+
+typedef struct
+{
+  NoteSnapshot working; /* changed by the writer between publishes */
+  NoteSnapshot buffers[3];
+  _Atomic uint32_t spare; /* index of the buffer neither side holds */
+  uint32_t back;          /* owned by the writer */
+  uint32_t front;         /* owned by the reader */
+  bool changed;           /* working differs from the last publish */
+} NoteState;
+
+void
+note_state_init (NoteState *state)
+{
+  memset (state, 0, sizeof (*state));
+  state->front = 0;
+  state->back = 1;
+  atomic_store (&state->spare, 2);
+}
+
+void
+note_state_on (NoteState *state, int channel, int key, int velocity,
+               uint32_t tick)
+{
+  NoteSnapshot *notes = &state->working;
+  notes->playing[channel][key >> 6] |= (uint64_t)1 << (key & 63);
+  notes->velocity[channel][key] = velocity;
+  notes->onset[channel][key] = tick;
+  state->changed = true;
+}
+
+void
+note_state_off (NoteState *state, int channel, int key)
+{
+  state->working.playing[channel][key >> 6] &= ~((uint64_t)1 << (key & 63));
+  state->changed = true;
+}
+
+/* Hand the working copy to the reader, call once per block.  Blocks
+ * without changes cost nothing.  */
+void
+note_state_publish (NoteState *state)
+{
+  if (!state->changed)
+    {
+      return;
+    }
+  memcpy (&state->buffers[state->back], &state->working,
+          sizeof (NoteSnapshot));
+  state->back = atomic_exchange_explicit (&state->spare,
+                                          state->back | NOTE_STATE_FRESH,
+                                          memory_order_acq_rel)
+                & ~NOTE_STATE_FRESH;
+  state->changed = false;
+}
+
+/* The last published block.  It stays untouched until the next call.  */
+const NoteSnapshot *
+note_state_read (NoteState *state)
+{
+  if (atomic_load_explicit (&state->spare, memory_order_relaxed)
+      & NOTE_STATE_FRESH)
+    {
+      state->front = atomic_exchange_explicit (&state->spare, state->front,
+                                               memory_order_acq_rel)
+                     & ~NOTE_STATE_FRESH;
+    }
+  return &state->buffers[state->front];
+}
+
+static inline bool
+note_snapshot_playing (const NoteSnapshot *notes, int channel, int key)
+{
+  return (notes->playing[channel][key >> 6] >> (key & 63)) & 1;
+}
@@ -0,0 +1,114 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "tsf.h"
+
+/* Optional real-time setup, see REALTIME_AUDIO in defines.h.  The audio
+ * thread and the render pool workers ask for SCHED_FIFO, the threads that
+ * feed them (disk streaming and render-ahead) for a lower SCHED_FIFO
+ * priority, and the soundfont and voice memory is locked into RAM before
+ * the stream starts.  Without CAP_SYS_NICE or a high enough rtprio and
+ * memlock limit any of these can be refused, the app then runs like
+ * before and realtime_print tells which steps took effect.  */
+
+#define REALTIME_AUDIO_PRIORITY 70
+#define REALTIME_FEEDER_PRIORITY 60
+
+typedef struct
+{
+  _Atomic int audio; /* 0 until the first callback, then 1 or -errno */
+  int threads;       /* other threads that asked for SCHED_FIFO */
+  int threads_promoted;
+  int thread_error; /* errno of the last refusal */
+  int memory;       /* TSFLockedMemory flags of tsf_lock_memory */
+  bool memory_tried;
+} Realtime;
+
+/* Ask for SCHED_FIFO at PRIORITY for THREAD.  Returns false when the
+ * system refused.  */
+bool
+realtime_thread (Realtime *rt, pthread_t thread, int priority)
+{
+  struct sched_param param;
+  memset (&param, 0, sizeof (param));
+  param.sched_priority = priority;
+  int error = pthread_setschedparam (thread, SCHED_FIFO, &param);
+  rt->threads++;
+  if (error != 0)
+    {
+      rt->thread_error = error;
+      return false;
+    }
+  rt->threads_promoted++;
+  return true;
+}
+
+/* raylib owns the audio thread, so it asks for itself: call this at the
+ * start of the audio callback, only the first call does anything.  */
+void
+realtime_audio_thread (Realtime *rt)
+{
+  if (atomic_load_explicit (&rt->audio, memory_order_relaxed) != 0)
+    {
+      return;
+    }
+  struct sched_param param;
+  memset (&param, 0, sizeof (param));
+  param.sched_priority = REALTIME_AUDIO_PRIORITY;
+  int error = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+  atomic_store_explicit (&rt->audio, error == 0 ? 1 : -error,
+                         memory_order_relaxed);
+}
+
+/* Lock and touch the memory SF renders from, call this after everything
+ * is allocated and before the stream starts.  */
+int
+realtime_lock (Realtime *rt, tsf *sf)
+{
+  rt->memory_tried = true;
+  rt->memory = tsf_lock_memory (sf);
+  return rt->memory;
+}
+
+void
+realtime_print (Realtime *rt, FILE *out)
+{
+  static const char *const memory_names[]
+      = { "samples", "presets", "voices" };
+  int audio = atomic_load (&rt->audio);
+  fprintf (out, "realtime: audio thread SCHED_FIFO %d ",
+           REALTIME_AUDIO_PRIORITY);
+  if (audio == 0)
+    {
+      fprintf (out, "not tried\n");
+    }
+  else if (audio > 0)
+    {
+      fprintf (out, "ok\n");
+    }
+  else
+    {
+      fprintf (out, "refused (%s)\n", strerror (-audio));
+    }
+  fprintf (out, "  other threads %d of %d", rt->threads_promoted,
+           rt->threads);
+  if (rt->threads_promoted < rt->threads)
+    {
+      fprintf (out, " (%s)", strerror (rt->thread_error));
+    }
+  fprintf (out, "\n  memory");
+  if (!rt->memory_tried)
+    {
+      fprintf (out, " not locked\n");
+      return;
+    }
+  for (int i = 0; i < 3; i++)
+    {
+      fprintf (out, " %s %s", memory_names[i],
+               rt->memory & (1 << i) ? "locked" : "touched only");
+      fprintf (out, i < 2 ? "," : "\n");
+    }
+}
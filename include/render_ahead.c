@@ -0,0 +1,350 @@
+#include <defines.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <uthash.h>
+#include "tsf.h"
+
+/* While the student only listens, the song does not need to be rendered
+ * just in time.  A worker thread plays it on its own copy of the soundfont
+ * a few hundred milliseconds ahead into a single producer, single consumer
+ * ring and the audio callback copies the ring out.  As soon as the student
+ * interacts render_ahead_stop joins the worker, the callback plays what is
+ * left in the ring and then keeps rendering the song just in time from
+ * where the worker stopped.  Notes the student plays never go through the
+ * ring, they are rendered just in time on the main soundfont all along.
+ *
+ * This file uses the MIDI types of midi.c and the DRUM_CHANNEL mapping of
+ * audio.c, include it after both.  */
+
+#define RENDER_AHEAD_MS 300
+#define RENDER_AHEAD_CHUNK 512 /* frames the worker renders at once */
+#define RENDER_AHEAD_FRAMES 32768 /* ring size, must be a power of two */
+
+/* Plays the events of a parsed MIDI file on a tsf, counting time in output
+ * frames.  The tempo is the one of the file header, like the main loop.  */
+typedef struct
+{
+  MidiEvent *events;
+  double frames_per_tick;
+  u64 frame;     /* frames rendered so far */
+  u64 tick;      /* next tick with events, above last_tick at the end */
+  u64 last_tick;
+  MidiEvent *next; /* events of TICK */
+} Sequencer;
+
+static void
+sequencer_seek (Sequencer *seq, u64 tick)
+{
+  seq->next = NULL;
+  for (; tick <= seq->last_tick; tick++)
+    {
+      HASH_FIND (hh, seq->events, &tick, sizeof (u64), seq->next);
+      if (seq->next != NULL)
+        {
+          break;
+        }
+    }
+  seq->tick = tick;
+}
+
+void
+sequencer_init (Sequencer *seq, MidiEvent *events, u32 division, int tempo,
+                int sample_rate)
+{
+  MidiEvent *s, *tmp;
+  memset (seq, 0, sizeof (*seq));
+  seq->events = events;
+  seq->frames_per_tick = (double)sample_rate * tempo / (division * 1e6);
+  HASH_ITER (hh, events, s, tmp)
+  {
+    if (s->delta_time > seq->last_tick)
+      {
+        seq->last_tick = s->delta_time;
+      }
+  }
+  sequencer_seek (seq, 0);
+}
+
+bool
+sequencer_finished (Sequencer *seq)
+{
+  return seq->next == NULL;
+}
+
+static void
+sequencer_apply (Sequencer *seq, tsf *sf)
+{
+  MidiEvent *s = seq->next;
+  for (u32 index = 0; index < s->size; index++)
+    {
+      EventValue ev = s->event_value[index];
+      int bank = ev.channel == DRUM_CHANNEL ? 128 : 0;
+      int program = ev.channel == DRUM_CHANNEL ? 0 : ev.program;
+      if (ev.event_type != BASIC_EVENT)
+        {
+          continue;
+        }
+      if (ev.event_id == NOTE_ON && ev.value.note.velocity != 0)
+        {
+          tsf_bank_note_on (sf, bank, program, ev.value.note.note,
+                            MIDI_VELOCITY (ev.value.note.velocity));
+        }
+      else if (ev.event_id == NOTE_ON || ev.event_id == NOTE_OFF)
+        {
+          tsf_bank_note_off (sf, bank, program, ev.value.note.note);
+        }
+    }
+}
+
+/* Render the next FRAMES stereo frames of the song into OUT, starting
+ * notes on the frame their tick falls on.  */
+void
+sequencer_render (Sequencer *seq, tsf *sf, float *out, int frames,
+                  int flag_mixing)
+{
+  while (frames > 0)
+    {
+      int count = frames;
+      while (seq->next != NULL
+             && (u64)(seq->tick * seq->frames_per_tick) <= seq->frame)
+        {
+          sequencer_apply (seq, sf);
+          sequencer_seek (seq, seq->tick + 1);
+        }
+      if (seq->next != NULL)
+        {
+          u64 at = (u64)(seq->tick * seq->frames_per_tick);
+          if (at - seq->frame < (u64)count)
+            {
+              count = (int)(at - seq->frame);
+            }
+        }
+      tsf_render_float (sf, out, count, flag_mixing);
+      seq->frame += count;
+      out += count * CHANNELS;
+      frames -= count;
+    }
+}
+
+typedef enum
+{
+  RENDER_AHEAD_OFF,
+  RENDER_AHEAD_RUNNING,  /* the worker renders, the callback reads */
+  RENDER_AHEAD_DRAINING, /* the callback reads, then renders the song */
+} RenderAheadState;
+
+typedef struct
+{
+  tsf *sf; /* copy of the main soundfont that only plays the song */
+  Sequencer seq;
+  pthread_t thread;
+  atomic_bool running;
+  _Atomic int state;
+  _Atomic uint32_t head; /* frames written, owned by the worker */
+  _Atomic uint32_t tail; /* frames read, owned by the audio thread */
+  _Atomic uint64_t underruns; /* callbacks the ring could not fill */
+  float chunk[RENDER_AHEAD_CHUNK * CHANNELS];
+  float ring[RENDER_AHEAD_FRAMES * CHANNELS];
+} RenderAhead;
+
+static void *
+render_ahead_worker (void *arg)
+{
+  RenderAhead *ahead = arg;
+  struct timespec idle = { 0, 2000000 };
+  uint32_t target = (uint32_t)SAMPLE_RATE * RENDER_AHEAD_MS / 1000;
+  if (target > RENDER_AHEAD_FRAMES - RENDER_AHEAD_CHUNK)
+    {
+      target = RENDER_AHEAD_FRAMES - RENDER_AHEAD_CHUNK;
+    }
+  while (atomic_load_explicit (&ahead->running, memory_order_relaxed))
+    {
+      uint32_t head
+          = atomic_load_explicit (&ahead->head, memory_order_relaxed);
+      uint32_t tail
+          = atomic_load_explicit (&ahead->tail, memory_order_acquire);
+      if (head - tail >= target)
+        {
+          nanosleep (&idle, NULL);
+          continue;
+        }
+      sequencer_render (&ahead->seq, ahead->sf, ahead->chunk,
+                        RENDER_AHEAD_CHUNK, 0);
+      uint32_t at = head & (RENDER_AHEAD_FRAMES - 1);
+      uint32_t first = RENDER_AHEAD_FRAMES - at;
+      if (first > RENDER_AHEAD_CHUNK)
+        {
+          first = RENDER_AHEAD_CHUNK;
+        }
+      memcpy (ahead->ring + at * CHANNELS, ahead->chunk,
+              first * CHANNELS * sizeof (float));
+      memcpy (ahead->ring, ahead->chunk + first * CHANNELS,
+              (RENDER_AHEAD_CHUNK - first) * CHANNELS * sizeof (float));
+      atomic_store_explicit (&ahead->head, head + RENDER_AHEAD_CHUNK,
+                             memory_order_release);
+    }
+  return NULL;
+}
+
+/* Make the copy of SF the song plays on, before the audio stream and
+ * the threads that use SF start.  The copy renders with INTERPOLATION and
+ * no voice limit, the worker is not in a hurry.  Returns false when the
+ * copy could not be made.  */
+bool
+render_ahead_init (RenderAhead *ahead, tsf *sf,
+                   enum TSFInterpolation interpolation)
+{
+  memset (ahead, 0, sizeof (*ahead));
+  ahead->sf = tsf_copy (sf);
+  if (ahead->sf == NULL)
+    {
+      return false;
+    }
+  if (!tsf_set_max_voices (ahead->sf, 128))
+    {
+      tsf_close (ahead->sf);
+      ahead->sf = NULL;
+      return false;
+    }
+  tsf_set_voice_limit (ahead->sf, 0);
+  if (!tsf_set_interpolation (ahead->sf, interpolation))
+    {
+      tsf_set_interpolation (ahead->sf, TSF_INTERPOLATION_LINEAR);
+    }
+  if (REALTIME_AUDIO)
+    {
+      /* Its voices render in the callback after an interaction.  */
+      tsf_lock_memory (ahead->sf);
+    }
+  return true;
+}
+
+/* Start playing the song of EVENTS ahead, once.  Returns false when
+ * render_ahead_init failed, the song already started or the thread could
+ * not be made.  */
+bool
+render_ahead_start (RenderAhead *ahead, MidiEvent *events, u32 division,
+                    int tempo)
+{
+  /* The callback leaves everything but the state alone until it reads
+     RENDER_AHEAD_RUNNING.  */
+  if (ahead->sf == NULL
+      || atomic_load_explicit (&ahead->state, memory_order_relaxed)
+             != RENDER_AHEAD_OFF)
+    {
+      return false;
+    }
+  sequencer_init (&ahead->seq, events, division, tempo, SAMPLE_RATE);
+  atomic_store_explicit (&ahead->head, 0, memory_order_relaxed);
+  atomic_store_explicit (&ahead->tail, 0, memory_order_relaxed);
+  atomic_store (&ahead->running, true);
+  if (pthread_create (&ahead->thread, NULL, render_ahead_worker, ahead) != 0)
+    {
+      atomic_store (&ahead->running, false);
+      return false;
+    }
+  atomic_store_explicit (&ahead->state, RENDER_AHEAD_RUNNING,
+                         memory_order_release);
+  return true;
+}
+
+/* The student started interacting: stop rendering ahead, the callback
+ * plays the rest of the ring and then renders the song just in time.  */
+void
+render_ahead_stop (RenderAhead *ahead)
+{
+  if (atomic_load (&ahead->state) != RENDER_AHEAD_RUNNING)
+    {
+      return;
+    }
+  atomic_store (&ahead->running, false);
+  pthread_join (ahead->thread, NULL);
+  atomic_store_explicit (&ahead->state, RENDER_AHEAD_DRAINING,
+                         memory_order_release);
+}
+
+/* Report the callbacks that found the ring short of frames.  */
+void
+render_ahead_print (RenderAhead *ahead, FILE *out)
+{
+  fprintf (out, "render ahead: %llu underruns\n",
+           (unsigned long long)atomic_load (&ahead->underruns));
+}
+
+/* Call this once the audio stream is stopped.  */
+void
+render_ahead_close (RenderAhead *ahead)
+{
+  render_ahead_stop (ahead);
+  atomic_store (&ahead->state, RENDER_AHEAD_OFF);
+  if (ahead->sf != NULL)
+    {
+      tsf_close (ahead->sf);
+      ahead->sf = NULL;
+    }
+}
+
+/* Add (or, with FLAG_MIXING 0, write) the next FRAMES frames of the song
+ * to OUT, call this from the audio callback.  */
+void
+render_ahead_read (RenderAhead *ahead, float *out, unsigned int frames,
+                   int flag_mixing)
+{
+  int state = atomic_load_explicit (&ahead->state, memory_order_acquire);
+  if (state == RENDER_AHEAD_OFF)
+    {
+      if (!flag_mixing)
+        {
+          memset (out, 0, frames * CHANNELS * sizeof (float));
+        }
+      return;
+    }
+  uint32_t tail = atomic_load_explicit (&ahead->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit (&ahead->head, memory_order_acquire);
+  uint32_t count = head - tail < frames ? head - tail : frames;
+  for (uint32_t done = 0; done < count;)
+    {
+      uint32_t at = (tail + done) & (RENDER_AHEAD_FRAMES - 1);
+      uint32_t run = RENDER_AHEAD_FRAMES - at;
+      if (run > count - done)
+        {
+          run = count - done;
+        }
+      float *from = ahead->ring + at * CHANNELS;
+      float *to = out + done * CHANNELS;
+      if (flag_mixing)
+        {
+          for (uint32_t i = 0; i < run * CHANNELS; i++)
+            {
+              to[i] += from[i];
+            }
+        }
+      else
+        {
+          memcpy (to, from, run * CHANNELS * sizeof (float));
+        }
+      done += run;
+    }
+  atomic_store_explicit (&ahead->tail, tail + count, memory_order_release);
+  if (count == frames)
+    {
+      return;
+    }
+  out += count * CHANNELS;
+  frames -= count;
+  if (state == RENDER_AHEAD_DRAINING)
+    {
+      sequencer_render (&ahead->seq, ahead->sf, out, frames, flag_mixing);
+      return;
+    }
+  atomic_fetch_add_explicit (&ahead->underruns, 1, memory_order_relaxed);
+  if (!flag_mixing)
+    {
+      memset (out, 0, frames * CHANNELS * sizeof (float));
+    }
+}
@@ -0,0 +1,244 @@
+#ifndef RT_CHECK_C
+#define RT_CHECK_C
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The audio callback must never wait on the allocator or a lock, a page
+ * fault or a contended mutex there is an audible dropout.  Builds made
+ * with -DAUDIO_RT_CHECK (make ear_trainer_rt_check) replace malloc,
+ * calloc, realloc, free, the pthread mutex and condition variable waits
+ * and sem_wait of the whole program with versions that abort with a
+ * backtrace when the audio callback calls them.  Mark the callback, and
+ * the threads that render on its behalf, with RT_CHECK_ENTER and
+ * RT_CHECK_LEAVE, in other builds both do nothing.  A wait that is part
+ * of the design goes in RT_CHECK_EXEMPT: the callback waiting for the
+ * render pool only waits for workers that are checked themselves.  Only
+ * glibc is supported.  */
+
+#ifdef AUDIO_RT_CHECK
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *pointer, size_t size);
+extern void __libc_free (void *pointer);
+
+typedef int (*rt_check_mutex_call) (pthread_mutex_t *mutex);
+static rt_check_mutex_call rt_check_mutex_lock;
+static rt_check_mutex_call rt_check_mutex_trylock;
+static rt_check_mutex_call rt_check_mutex_unlock;
+static int (*rt_check_cond_wait) (pthread_cond_t *cond,
+                                  pthread_mutex_t *mutex);
+static int (*rt_check_cond_timedwait) (pthread_cond_t *cond,
+                                       pthread_mutex_t *mutex,
+                                       const struct timespec *abstime);
+static int (*rt_check_sem_wait) (sem_t *sem);
+static int (*rt_check_sem_timedwait) (sem_t *sem,
+                                      const struct timespec *abstime);
+
+static __thread bool rt_check_inside = false;
+
+/* The condition variable calls have an older version on some targets,
+ * dlsym could find that one.  */
+static void *
+rt_check_lookup_cond (const char *name)
+{
+  void *call = dlvsym (RTLD_NEXT, name, "GLIBC_2.3.2");
+  return call != NULL ? call : dlsym (RTLD_NEXT, name);
+}
+
+/* Look the real calls up before main, dlsym allocates.  Mutexes locked by
+ * other constructors look them up on first use.  */
+__attribute__ ((constructor)) static void
+rt_check_init (void)
+{
+  rt_check_mutex_lock
+      = (rt_check_mutex_call)dlsym (RTLD_NEXT, "pthread_mutex_lock");
+  rt_check_mutex_trylock
+      = (rt_check_mutex_call)dlsym (RTLD_NEXT, "pthread_mutex_trylock");
+  rt_check_mutex_unlock
+      = (rt_check_mutex_call)dlsym (RTLD_NEXT, "pthread_mutex_unlock");
+  rt_check_cond_wait = rt_check_lookup_cond ("pthread_cond_wait");
+  rt_check_cond_timedwait = rt_check_lookup_cond ("pthread_cond_timedwait");
+  rt_check_sem_wait = dlsym (RTLD_NEXT, "sem_wait");
+  rt_check_sem_timedwait = dlsym (RTLD_NEXT, "sem_timedwait");
+}
+
+#define RT_CHECK_ENTER() (rt_check_inside = true)
+#define RT_CHECK_LEAVE() (rt_check_inside = false)
+#define RT_CHECK_EXEMPT(call)                                                 \
+  do                                                                          \
+    {                                                                         \
+      bool rt_check_was_inside = rt_check_inside;                             \
+      rt_check_inside = false;                                                \
+      call;                                                                   \
+      rt_check_inside = rt_check_was_inside;                                  \
+    }                                                                         \
+  while (0)
+
+static void
+rt_check_fail (const char *call)
+{
+  static const char message[] = "audio callback called ";
+  void *frames[64];
+  int count;
+  /* backtrace may allocate the first time it runs.  */
+  rt_check_inside = false;
+  write (STDERR_FILENO, message, sizeof (message) - 1);
+  write (STDERR_FILENO, call, strlen (call));
+  write (STDERR_FILENO, "\n", 1);
+  count = backtrace (frames, 64);
+  backtrace_symbols_fd (frames, count, STDERR_FILENO);
+  abort ();
+}
+
+void *
+malloc (size_t size)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("malloc");
+    }
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t count, size_t size)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("calloc");
+    }
+  return __libc_calloc (count, size);
+}
+
+void *
+realloc (void *pointer, size_t size)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("realloc");
+    }
+  return __libc_realloc (pointer, size);
+}
+
+void
+free (void *pointer)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("free");
+    }
+  __libc_free (pointer);
+}
+
+int
+pthread_mutex_lock (pthread_mutex_t *mutex)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("pthread_mutex_lock");
+    }
+  if (rt_check_mutex_lock == NULL)
+    {
+      rt_check_init ();
+    }
+  return rt_check_mutex_lock (mutex);
+}
+
+int
+pthread_mutex_trylock (pthread_mutex_t *mutex)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("pthread_mutex_trylock");
+    }
+  if (rt_check_mutex_trylock == NULL)
+    {
+      rt_check_init ();
+    }
+  return rt_check_mutex_trylock (mutex);
+}
+
+int
+pthread_mutex_unlock (pthread_mutex_t *mutex)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("pthread_mutex_unlock");
+    }
+  if (rt_check_mutex_unlock == NULL)
+    {
+      rt_check_init ();
+    }
+  return rt_check_mutex_unlock (mutex);
+}
+
+int
+pthread_cond_wait (pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("pthread_cond_wait");
+    }
+  if (rt_check_cond_wait == NULL)
+    {
+      rt_check_init ();
+    }
+  return rt_check_cond_wait (cond, mutex);
+}
+
+int
+pthread_cond_timedwait (pthread_cond_t *cond, pthread_mutex_t *mutex,
+                        const struct timespec *abstime)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("pthread_cond_timedwait");
+    }
+  if (rt_check_cond_timedwait == NULL)
+    {
+      rt_check_init ();
+    }
+  return rt_check_cond_timedwait (cond, mutex, abstime);
+}
+
+int
+sem_wait (sem_t *sem)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("sem_wait");
+    }
+  if (rt_check_sem_wait == NULL)
+    {
+      rt_check_init ();
+    }
+  return rt_check_sem_wait (sem);
+}
+
+int
+sem_timedwait (sem_t *sem, const struct timespec *abstime)
+{
+  if (rt_check_inside)
+    {
+      rt_check_fail ("sem_timedwait");
+    }
+  if (rt_check_sem_timedwait == NULL)
+    {
+      rt_check_init ();
+    }
+  return rt_check_sem_timedwait (sem, abstime);
+}
+#else
+#define RT_CHECK_ENTER() ((void)0)
+#define RT_CHECK_LEAVE() ((void)0)
+#define RT_CHECK_EXEMPT(call) call
+#endif
+#endif
@@ -0,0 +1,213 @@
+#include <defines.h>
+#include <raylib.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tsf.h"
+
+/* A one-shot sample player for slow machines.  Every note an exercise
+ * needs is rendered once from the soundfont, at the velocity it is played
+ * with, into a raylib Sound; playing it later only costs raylib's mixer.
+ * Notes play through a fixed pool of sound aliases, so the same note can
+ * sound several times at once, and a note let go early fades out over
+ * SAMPLED_RELEASE_SECONDS.  All of it runs on the main thread.  */
+
+#define SAMPLED_HOLD_MS 1000 /* notes are rendered held this long */
+#define SAMPLED_TAIL_MS 500  /* and followed by this much release */
+#define SAMPLED_RELEASE_SECONDS 0.15f
+
+typedef struct
+{
+  int bank;
+  int preset;
+  int velocity; /* MIDI velocity the notes were rendered with */
+  Sound notes[NUMBER_OF_NOTE];
+  bool ready[NUMBER_OF_NOTE];
+} SampledInstrument;
+
+typedef struct
+{
+  Sound sound; /* alias of a note of instrument */
+  bool free;
+  float playing_time; // seconds
+  float volume;
+  const SampledInstrument *instrument;
+  int note;
+  bool releasing;
+} ReleaseSound;
+
+/* Render the notes LOW to HIGH of PRESET in BANK at the MIDI VELOCITY on
+ * a copy of SF.  Returns the number of notes rendered.  */
+int
+sampled_instrument_render (SampledInstrument *instrument, tsf *sf, int bank,
+                           int preset, int low, int high, int velocity)
+{
+  int hold = SAMPLE_RATE * SAMPLED_HOLD_MS / 1000;
+  int length = hold + SAMPLE_RATE * SAMPLED_TAIL_MS / 1000;
+  int rendered = 0;
+  instrument->bank = bank;
+  instrument->preset = preset;
+  instrument->velocity = velocity;
+  tsf *copy = tsf_copy (sf);
+  float *pcm = malloc ((size_t)length * sizeof (float));
+  if (copy == NULL || pcm == NULL)
+    {
+      tsf_close (copy);
+      free (pcm);
+      return 0;
+    }
+  tsf_set_output (copy, TSF_MONO, SAMPLE_RATE, 0.0f);
+  if (!tsf_set_max_voices (copy, 16))
+    {
+      tsf_close (copy);
+      free (pcm);
+      return 0;
+    }
+  for (int note = low < 0 ? 0 : low; note <= high && note < NUMBER_OF_NOTE;
+       note++)
+    {
+      if (instrument->ready[note]
+          || !tsf_bank_note_on (copy, bank, preset, note,
+                                MIDI_VELOCITY (velocity)))
+        {
+          continue;
+        }
+      tsf_render_float (copy, pcm, hold, 0);
+      tsf_bank_note_off (copy, bank, preset, note);
+      tsf_render_float (copy, pcm + hold, length - hold, 0);
+      Wave wave = { (unsigned int)length, SAMPLE_RATE, 32, 1, pcm };
+      instrument->notes[note] = LoadSoundFromWave (wave);
+      instrument->ready[note] = IsSoundValid (instrument->notes[note]);
+      rendered += instrument->ready[note];
+      /* Silence what is left before the next note.  */
+      tsf_reset (copy);
+      for (int i = 0; i < 64 && tsf_active_voice_count (copy) > 0; i++)
+        {
+          tsf_render_float (copy, pcm, length < 512 ? length : 512, 0);
+        }
+    }
+  free (pcm);
+  tsf_close (copy);
+  return rendered;
+}
+
+void
+sampled_instrument_unload (SampledInstrument *instrument)
+{
+  for (int note = 0; note < NUMBER_OF_NOTE; note++)
+    {
+      if (instrument->ready[note])
+        {
+          UnloadSound (instrument->notes[note]);
+          instrument->ready[note] = false;
+        }
+    }
+}
+
+void
+sampler_init (ReleaseSound *pool, int count)
+{
+  memset (pool, 0, count * sizeof (*pool));
+  for (int i = 0; i < count; i++)
+    {
+      pool[i].free = true;
+    }
+}
+
+static void
+sampler_free (ReleaseSound *slot)
+{
+  StopSound (slot->sound);
+  UnloadSoundAlias (slot->sound);
+  slot->free = true;
+}
+
+/* Play NOTE of INSTRUMENT, taking the slot that played longest when the
+ * pool is full.  Returns false when the note was not rendered.  */
+bool
+sampler_note_on (ReleaseSound *pool, int count,
+                 const SampledInstrument *instrument, int note)
+{
+  if (note < 0 || note >= NUMBER_OF_NOTE || !instrument->ready[note])
+    {
+      return false;
+    }
+  ReleaseSound *slot = NULL;
+  for (int i = 0; i < count; i++)
+    {
+      if (pool[i].free)
+        {
+          slot = &pool[i];
+          break;
+        }
+      if (slot == NULL || pool[i].playing_time > slot->playing_time)
+        {
+          slot = &pool[i];
+        }
+    }
+  if (!slot->free)
+    {
+      sampler_free (slot);
+    }
+  slot->sound = LoadSoundAlias (instrument->notes[note]);
+  slot->free = false;
+  slot->playing_time = 0.0f;
+  slot->volume = 1.0f;
+  slot->instrument = instrument;
+  slot->note = note;
+  slot->releasing = false;
+  PlaySound (slot->sound);
+  return true;
+}
+
+/* Fade out every sounding NOTE of INSTRUMENT.  */
+void
+sampler_note_off (ReleaseSound *pool, int count,
+                  const SampledInstrument *instrument, int note)
+{
+  for (int i = 0; i < count; i++)
+    {
+      if (!pool[i].free && pool[i].instrument == instrument
+          && pool[i].note == note)
+        {
+          pool[i].releasing = true;
+        }
+    }
+}
+
+/* Advance the fades by DT seconds and give back the slots of finished
+ * notes, call this once per frame.  */
+void
+sampler_update (ReleaseSound *pool, int count, float dt)
+{
+  for (int i = 0; i < count; i++)
+    {
+      ReleaseSound *slot = &pool[i];
+      if (slot->free)
+        {
+          continue;
+        }
+      slot->playing_time += dt;
+      if (slot->releasing)
+        {
+          slot->volume -= dt / SAMPLED_RELEASE_SECONDS;
+          SetSoundVolume (slot->sound, slot->volume > 0 ? slot->volume : 0);
+        }
+      if (slot->volume <= 0 || !IsSoundPlaying (slot->sound))
+        {
+          sampler_free (slot);
+        }
+    }
+}
+
+void
+sampler_stop_all (ReleaseSound *pool, int count)
+{
+  for (int i = 0; i < count; i++)
+    {
+      if (!pool[i].free)
+        {
+          sampler_free (&pool[i]);
+        }
+    }
+}
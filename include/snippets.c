@@ -0,0 +1,506 @@
+#include <defines.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tsf.h"
+
+/* Drills replay the same few stimuli over and over, an interval on one
+ * preset, a chord voicing on another.  The snippet cache keeps them as
+ * rendered PCM, keyed by everything that changes the sound, and evicts
+ * the least recently played ones to stay inside a byte budget.  A miss
+ * renders on a worker thread with its own copy of the soundfont, a hit
+ * costs the audio callback one add per sample.
+ *
+ * The main thread owns the lookup, the LRU order and the budget.  The
+ * worker only fills the buffers it is handed and the callback only reads
+ * buffers it was told to play, each entry counts the players using it and
+ * is never evicted while one does.  */
+
+#define SNIPPET_MAX_NOTES 8
+#define SNIPPET_ENTRIES 64 /* must be a power of two */
+#define SNIPPET_PLAYERS 8  /* snippets the callback mixes at once */
+#define SNIPPET_TAIL_MS 1500 /* longest release rendered after the notes */
+#define SNIPPET_CHUNK 1024
+
+/* Build keys with snippet_key, the padding takes part in comparisons.  */
+typedef struct
+{
+  uint16_t bank;
+  uint16_t preset;
+  uint16_t tempo; /* beats per minute */
+  uint8_t stagger; /* sixteenths between note starts, 0 plays a chord */
+  uint8_t duration; /* sixteenths each note is held */
+  uint8_t count;
+  uint8_t notes[SNIPPET_MAX_NOTES];
+  uint8_t velocities[SNIPPET_MAX_NOTES]; /* MIDI velocities */
+} SnippetKey;
+
+typedef enum
+{
+  SNIPPET_EMPTY,
+  SNIPPET_RENDERING,
+  SNIPPET_READY,
+} SnippetState;
+
+typedef struct
+{
+  SnippetKey key;
+  _Atomic int state;
+  _Atomic int playing; /* players of the callback reading pcm */
+  float *pcm;          /* written by the worker while RENDERING */
+  uint32_t frames;
+  /* Main thread only.  */
+  size_t bytes; /* charged against the budget */
+  uint64_t last_used;
+  int pending; /* plays asked for before the render finished */
+  bool settled; /* READY has been seen and accounted for */
+} Snippet;
+
+typedef struct
+{
+  Snippet *snippet;
+  uint32_t position;
+} SnippetPlayer;
+
+typedef struct
+{
+  tsf *sf; /* copy that only the worker renders with */
+  float silence[SNIPPET_CHUNK * CHANNELS]; /* leftover tails go here */
+  pthread_t thread;
+  sem_t wake;
+  atomic_bool running;
+  size_t budget;
+  size_t used;
+  uint64_t clock;
+  Snippet entries[SNIPPET_ENTRIES];
+  /* Renders asked for, from the main thread to the worker.  At most
+     SNIPPET_ENTRIES can be pending, so the ring never fills.  */
+  Snippet *requests[SNIPPET_ENTRIES];
+  _Atomic uint32_t request_head;
+  _Atomic uint32_t request_tail;
+  /* Plays started, from the main thread to the callback.  */
+  Snippet *starts[SNIPPET_PLAYERS];
+  _Atomic uint32_t start_head;
+  _Atomic uint32_t start_tail;
+  SnippetPlayer players[SNIPPET_PLAYERS]; /* callback only */
+  int player_count;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t dropped; /* plays that found no room in the budget or mixer */
+} SnippetCache;
+
+SnippetKey
+snippet_key (int bank, int preset, const uint8_t *notes,
+             const uint8_t *velocities, int count, int tempo, int stagger,
+             int duration)
+{
+  SnippetKey key;
+  memset (&key, 0, sizeof (key));
+  if (count > SNIPPET_MAX_NOTES)
+    {
+      count = SNIPPET_MAX_NOTES;
+    }
+  key.bank = bank;
+  key.preset = preset;
+  key.tempo = tempo > 0 ? tempo : 1;
+  key.stagger = stagger;
+  key.duration = duration;
+  key.count = count;
+  memcpy (key.notes, notes, count);
+  memcpy (key.velocities, velocities, count);
+  return key;
+}
+
+static uint32_t
+snippet_step (const SnippetKey *key)
+{
+  return SAMPLE_RATE * 15 / key->tempo; /* frames per sixteenth */
+}
+
+/* Frames until the last note is released.  */
+static uint32_t
+snippet_notes_end (const SnippetKey *key)
+{
+  int starts = key->count > 0 ? key->count - 1 : 0;
+  return (key->stagger * starts + key->duration) * snippet_step (key);
+}
+
+static uint32_t
+snippet_max_frames (const SnippetKey *key)
+{
+  return snippet_notes_end (key) + SNIPPET_TAIL_MS * SAMPLE_RATE / 1000;
+}
+
+/* End every voice of the worker copy.  tsf_reset only starts a quick
+ * release, which would still sound at the start of the next snippet, so
+ * the voices are rendered away until none is left.  */
+static void
+snippet_silence (SnippetCache *cache)
+{
+  tsf_reset (cache->sf);
+  for (int frame = 0;
+       frame < SAMPLE_RATE && tsf_active_voice_count (cache->sf) > 0;
+       frame += SNIPPET_CHUNK)
+    {
+      tsf_render_float (cache->sf, cache->silence, SNIPPET_CHUNK, 0);
+    }
+}
+
+/* Play the notes of S on the worker copy and keep what comes out, up to
+ * the end of the release tails.  */
+static void
+snippet_render (SnippetCache *cache, Snippet *s)
+{
+  const SnippetKey *key = &s->key;
+  uint32_t step = snippet_step (key), notes_end = snippet_notes_end (key);
+  uint32_t limit = snippet_max_frames (key), frame = 0;
+  float *pcm = malloc ((size_t)limit * CHANNELS * sizeof (float));
+  if (pcm == NULL)
+    {
+      s->pcm = NULL;
+      s->frames = 0;
+      return;
+    }
+  snippet_silence (cache);
+  while (frame < limit)
+    {
+      uint32_t next = limit;
+      for (int i = 0; i < key->count; i++)
+        {
+          uint32_t on = i * key->stagger * step;
+          uint32_t off = on + key->duration * step;
+          if (on == frame)
+            {
+              tsf_bank_note_on (cache->sf, key->bank, key->preset,
+                                key->notes[i],
+                                MIDI_VELOCITY (key->velocities[i]));
+            }
+          if (off == frame)
+            {
+              tsf_bank_note_off (cache->sf, key->bank, key->preset,
+                                 key->notes[i]);
+            }
+          if (on > frame && on < next)
+            {
+              next = on;
+            }
+          if (off > frame && off < next)
+            {
+              next = off;
+            }
+        }
+      if (frame >= notes_end && tsf_active_voice_count (cache->sf) == 0)
+        {
+          break;
+        }
+      if (next - frame > SNIPPET_CHUNK)
+        {
+          next = frame + SNIPPET_CHUNK;
+        }
+      tsf_render_float (cache->sf, pcm + (size_t)frame * CHANNELS,
+                        next - frame, 0);
+      frame = next;
+    }
+  float *shrunk
+      = realloc (pcm, ((size_t)frame + 1) * CHANNELS * sizeof (float));
+  s->pcm = shrunk != NULL ? shrunk : pcm;
+  s->frames = frame;
+}
+
+static void *
+snippet_worker (void *arg)
+{
+  SnippetCache *cache = arg;
+  for (;;)
+    {
+      sem_wait (&cache->wake);
+      if (!atomic_load (&cache->running))
+        {
+          return NULL;
+        }
+      uint32_t tail
+          = atomic_load_explicit (&cache->request_tail, memory_order_relaxed);
+      uint32_t head
+          = atomic_load_explicit (&cache->request_head, memory_order_acquire);
+      for (; tail != head; tail++)
+        {
+          Snippet *s = cache->requests[tail & (SNIPPET_ENTRIES - 1)];
+          snippet_render (cache, s);
+          atomic_store_explicit (&s->state, SNIPPET_READY,
+                                 memory_order_release);
+        }
+      atomic_store_explicit (&cache->request_tail, tail,
+                             memory_order_release);
+    }
+}
+
+/* Keep up to BUDGET bytes of snippets rendered on a copy of SF.  */
+bool
+snippet_cache_start (SnippetCache *cache, tsf *sf, size_t budget)
+{
+  memset (cache, 0, sizeof (*cache));
+  cache->budget = budget;
+  cache->sf = tsf_copy (sf);
+  if (cache->sf == NULL)
+    {
+      return false;
+    }
+  if (!tsf_set_max_voices (cache->sf, 64))
+    {
+      tsf_close (cache->sf);
+      return false;
+    }
+  tsf_set_voice_limit (cache->sf, 0);
+  atomic_store (&cache->running, true);
+  if (sem_init (&cache->wake, 0, 0) != 0)
+    {
+      tsf_close (cache->sf);
+      return false;
+    }
+  if (pthread_create (&cache->thread, NULL, snippet_worker, cache) != 0)
+    {
+      sem_destroy (&cache->wake);
+      tsf_close (cache->sf);
+      return false;
+    }
+  return true;
+}
+
+/* Call this once the audio stream is stopped.  */
+void
+snippet_cache_stop (SnippetCache *cache)
+{
+  atomic_store (&cache->running, false);
+  sem_post (&cache->wake);
+  pthread_join (cache->thread, NULL);
+  sem_destroy (&cache->wake);
+  for (int i = 0; i < SNIPPET_ENTRIES; i++)
+    {
+      free (cache->entries[i].pcm);
+    }
+  tsf_close (cache->sf);
+}
+
+static bool
+snippet_start (SnippetCache *cache, Snippet *s)
+{
+  uint32_t head
+      = atomic_load_explicit (&cache->start_head, memory_order_relaxed);
+  uint32_t tail
+      = atomic_load_explicit (&cache->start_tail, memory_order_acquire);
+  if (head - tail == SNIPPET_PLAYERS)
+    {
+      cache->dropped++;
+      return false;
+    }
+  atomic_fetch_add_explicit (&s->playing, 1, memory_order_relaxed);
+  cache->starts[head & (SNIPPET_PLAYERS - 1)] = s;
+  atomic_store_explicit (&cache->start_head, head + 1, memory_order_release);
+  return true;
+}
+
+static void
+snippet_evict (SnippetCache *cache, Snippet *s)
+{
+  free (s->pcm);
+  s->pcm = NULL;
+  s->frames = 0;
+  cache->used -= s->bytes;
+  s->bytes = 0;
+  atomic_store_explicit (&s->state, SNIPPET_EMPTY, memory_order_relaxed);
+  cache->evictions++;
+}
+
+/* The least recently played entry that nobody is rendering or playing,
+ * or an empty one when there is one.  */
+static Snippet *
+snippet_victim (SnippetCache *cache, bool want_empty)
+{
+  Snippet *victim = NULL;
+  for (int i = 0; i < SNIPPET_ENTRIES; i++)
+    {
+      Snippet *s = &cache->entries[i];
+      int state = atomic_load_explicit (&s->state, memory_order_relaxed);
+      if (state == SNIPPET_EMPTY)
+        {
+          if (want_empty)
+            {
+              return s;
+            }
+          continue;
+        }
+      if (state != SNIPPET_READY || !s->settled || s->pending > 0
+          || atomic_load_explicit (&s->playing, memory_order_acquire) > 0)
+        {
+          continue;
+        }
+      if (victim == NULL || s->last_used < victim->last_used)
+        {
+          victim = s;
+        }
+    }
+  return victim;
+}
+
+/* Play the snippet of KEY, rendering it first when it is not cached.
+ * Call this on the main thread.  Returns false when it cannot be played
+ * because the budget or the mixer is full.  */
+bool
+snippet_play (SnippetCache *cache, const SnippetKey *key)
+{
+  cache->clock++;
+  for (int i = 0; i < SNIPPET_ENTRIES; i++)
+    {
+      Snippet *s = &cache->entries[i];
+      if (atomic_load_explicit (&s->state, memory_order_relaxed)
+              == SNIPPET_EMPTY
+          || memcmp (&s->key, key, sizeof (*key)) != 0)
+        {
+          continue;
+        }
+      s->last_used = cache->clock;
+      cache->hits++;
+      if (!s->settled)
+        {
+          s->pending++;
+          return true;
+        }
+      return snippet_start (cache, s);
+    }
+
+  /* Until it is rendered an entry is charged its longest length.  */
+  size_t bytes = (size_t)snippet_max_frames (key) * CHANNELS * sizeof (float);
+  Snippet *s;
+  cache->misses++;
+  while (cache->used + bytes > cache->budget
+         && (s = snippet_victim (cache, false)) != NULL)
+    {
+      snippet_evict (cache, s);
+    }
+  s = snippet_victim (cache, true);
+  if (s != NULL && atomic_load (&s->state) != SNIPPET_EMPTY)
+    {
+      snippet_evict (cache, s);
+    }
+  if (s == NULL || cache->used + bytes > cache->budget)
+    {
+      cache->dropped++;
+      return false;
+    }
+  s->key = *key;
+  s->bytes = bytes;
+  s->last_used = cache->clock;
+  s->pending = 1;
+  s->settled = false;
+  cache->used += bytes;
+  atomic_store_explicit (&s->state, SNIPPET_RENDERING, memory_order_relaxed);
+  uint32_t head
+      = atomic_load_explicit (&cache->request_head, memory_order_relaxed);
+  cache->requests[head & (SNIPPET_ENTRIES - 1)] = s;
+  atomic_store_explicit (&cache->request_head, head + 1,
+                         memory_order_release);
+  sem_post (&cache->wake);
+  return true;
+}
+
+/* Start the plays that waited for their render, call this on the main
+ * thread once per frame.  */
+void
+snippet_cache_update (SnippetCache *cache)
+{
+  for (int i = 0; i < SNIPPET_ENTRIES; i++)
+    {
+      Snippet *s = &cache->entries[i];
+      if (s->settled
+          || atomic_load_explicit (&s->state, memory_order_acquire)
+                 != SNIPPET_READY)
+        {
+          continue;
+        }
+      if (s->pcm == NULL)
+        {
+          /* The worker could not allocate it: give the entry and its
+             charge back and drop the plays that waited.  */
+          cache->used -= s->bytes;
+          s->bytes = 0;
+          cache->dropped += s->pending;
+          s->pending = 0;
+          atomic_store_explicit (&s->state, SNIPPET_EMPTY,
+                                 memory_order_relaxed);
+          continue;
+        }
+      s->settled = true;
+      cache->used -= s->bytes;
+      s->bytes = ((size_t)s->frames + 1) * CHANNELS * sizeof (float);
+      cache->used += s->bytes;
+      for (; s->pending > 0; s->pending--)
+        {
+          snippet_start (cache, s);
+        }
+    }
+}
+
+/* Add the playing snippets to the FRAMES stereo frames of OUT, call this
+ * from the audio callback.  */
+void
+snippet_cache_mix (SnippetCache *cache, float *out, unsigned int frames)
+{
+  uint32_t tail
+      = atomic_load_explicit (&cache->start_tail, memory_order_relaxed);
+  uint32_t head
+      = atomic_load_explicit (&cache->start_head, memory_order_acquire);
+  for (; tail != head; tail++)
+    {
+      Snippet *s = cache->starts[tail & (SNIPPET_PLAYERS - 1)];
+      if (cache->player_count == SNIPPET_PLAYERS)
+        {
+          atomic_fetch_sub_explicit (&s->playing, 1, memory_order_release);
+          continue;
+        }
+      cache->players[cache->player_count].snippet = s;
+      cache->players[cache->player_count].position = 0;
+      cache->player_count++;
+    }
+  atomic_store_explicit (&cache->start_tail, tail, memory_order_release);
+
+  for (int i = 0; i < cache->player_count;)
+    {
+      SnippetPlayer *player = &cache->players[i];
+      Snippet *s = player->snippet;
+      uint32_t count = s->frames - player->position;
+      if (count > frames)
+        {
+          count = frames;
+        }
+      const float *from = s->pcm + (size_t)player->position * CHANNELS;
+      for (uint32_t j = 0; j < count * CHANNELS; j++)
+        {
+          out[j] += from[j];
+        }
+      player->position += count;
+      if (player->position < s->frames)
+        {
+          i++;
+          continue;
+        }
+      atomic_fetch_sub_explicit (&s->playing, 1, memory_order_release);
+      *player = cache->players[--cache->player_count];
+    }
+}
+
+void
+snippet_cache_print (SnippetCache *cache, FILE *out)
+{
+  fprintf (out,
+           "snippets: %llu hits, %llu misses, %llu evictions, %llu dropped, "
+           "%zu of %zu bytes\n",
+           (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+           (unsigned long long)cache->evictions,
+           (unsigned long long)cache->dropped, cache->used, cache->budget);
+}
@@ -10,9 +10,11 @@
    #include "tsf.h"
 
    [OPTIONAL] #define TSF_NO_STDIO to remove stdio dependency
+   [OPTIONAL] #define TSF_NO_MMAP to remove the memory mapped loader (sys/mman.h dependency)
    [OPTIONAL] #define TSF_MALLOC, TSF_REALLOC, and TSF_FREE to avoid stdlib.h
    [OPTIONAL] #define TSF_MEMCPY, TSF_MEMSET to avoid string.h
-   [OPTIONAL] #define TSF_POW, TSF_POWF, TSF_EXPF, TSF_LOG, TSF_TAN, TSF_LOG10, TSF_SQRT to avoid math.h
+   [OPTIONAL] #define TSF_POW, TSF_POWF, TSF_EXPF, TSF_LOG, TSF_TAN, TSF_SIN, TSF_COS, TSF_LOG10, TSF_SQRT to avoid math.h
+   [OPTIONAL] #define TSF_NO_SIMD to use plain C instead of SSE/NEON intrinsics
 
    NOT YET IMPLEMENTED
      - Support for ChorusEffectsSend and ReverbEffectsSend generators
@@ -68,6 +70,29 @@ typedef struct tsf tsf;
 #ifndef TSF_NO_STDIO
 // Directly load a SoundFont from a .sf2 file path
 TSFDEF tsf* tsf_load_filename(const char* filename);
+
+// Load a SoundFont by memory mapping the .sf2 file
+// Only the preset and instrument headers are parsed, the sample data is referenced
+// in place and paged in by the OS when first played (or when prefetched with
+// tsf_prefetch_preset). Compressed (.sf3) samples are still decoded into memory.
+// On platforms without mmap support this is the same as tsf_load_filename.
+TSFDEF tsf* tsf_load_filename_mapped(const char* filename);
+
+// Load a SoundFont that streams its sample data from the .sf2 file while playing
+// Only the first resident_ms milliseconds of every sample (and sample loops) are kept in memory.
+// When a voice plays past that, the rest is read into a ring buffer of buffer_ms milliseconds.
+// Up to max_streams voices can stream at the same time, others play only the resident part.
+// The reading is done by tsf_disk_service which must be called continuously on an I/O thread.
+// Data that isn't read in time is played as silence, rendering never waits for the I/O thread.
+// Compressed (.sf3) samples can't be streamed, they are decoded into memory like tsf_load_filename.
+TSFDEF tsf* tsf_load_filename_streaming(const char* filename, int resident_ms, int max_streams, int buffer_ms);
+
+// Read the sample data needed next by streaming voices (call this from the I/O thread)
+// Returns the number of samples read, if zero there is nothing to do and the thread can sleep a bit.
+TSFDEF int tsf_disk_service(tsf* f);
+
+// Returns how many blocks of a voice played some samples as silence because data wasn't read in time
+TSFDEF unsigned int tsf_disk_get_underruns(const tsf* f);
 #endif
 
 // Load a SoundFont from a block of memory
@@ -89,6 +114,43 @@ struct tsf_stream
 // Generic SoundFont loading method using the stream structure above
 TSFDEF tsf* tsf_load(struct tsf_stream* stream);
 
+// A preset (and the keys played on it) requested from the subset loading functions
+struct tsf_preset_key_set
+{
+	unsigned short bank, preset_number;
+
+	// Bit mask of the MIDI keys that will be played (key k is bit k%32 of keys[k/32])
+	// Leave it all zero to keep the regions of every key.
+	unsigned int keys[4];
+};
+
+// Load only the listed presets of a SoundFont, with just the regions and sample data they use
+// Listed presets that don't exist in the SoundFont are ignored. The loaded presets get their
+// own preset indices, use tsf_get_presetindex or the tsf_bank_* functions to address them.
+// With mmap support tsf_load_filename_subset reads only the needed sample data from the file.
+//   needed: array of presets to load
+//   needed_count: number of entries in the needed array
+TSFDEF tsf* tsf_load_subset(struct tsf_stream* stream, const struct tsf_preset_key_set* needed, int needed_count);
+#ifndef TSF_NO_STDIO
+TSFDEF tsf* tsf_load_filename_subset(const char* filename, const struct tsf_preset_key_set* needed, int needed_count);
+
+// Save the loaded presets and regions (and optionally the sample data) into a cache file
+// Loading it with tsf_load_cache skips parsing the SoundFont, everything is used as stored.
+// The cache is keyed by a hash of the .sf2 file's preset/instrument/sample headers.
+// Cache files depend on the tsf build (struct layout, byte order) and are not portable.
+//   sf2_filename: the .sf2 file the instance was loaded from
+//   with_samples: store the samples as floats, otherwise they get memory mapped from the .sf2 file
+//                 (not possible for subset loaded instances, streaming ones can't store samples)
+// Returns 1 on success, 0 on failure
+TSFDEF int tsf_save_cache(const tsf* f, const char* cache_filename, const char* sf2_filename, int with_samples);
+
+// Load a SoundFont from a cache file written by tsf_save_cache
+// Returns NULL if the cache is missing, damaged, from another tsf build or doesn't match the .sf2 file.
+// With mmap support this only maps the file, sample data gets paged in when used.
+// Caches saved without samples can only be loaded with mmap support.
+TSFDEF tsf* tsf_load_cache(const char* cache_filename, const char* sf2_filename);
+#endif
+
 // Copy a tsf instance from an existing one, use tsf_close to close it as well.
 // All copied tsf instances and their original instance are linked, and share the underlying soundfont.
 // This allows loading a soundfont only once, but using it for multiple independent playbacks.
@@ -104,6 +166,11 @@ TSFDEF void tsf_reset(tsf* f);
 // Returns the preset index from a bank and preset number, or -1 if it does not exist in the loaded SoundFont
 TSFDEF int tsf_get_presetindex(const tsf* f, int bank, int preset_number);
 
+// Returns the preset index from a bank and preset number with the fallbacks of General MIDI players
+// when the bank doesn't have the preset. Drums (flag_mididrums) try bank 128|bank, 128, the standard
+// kit (128, 0) and then the melodic bank, everything falls back to bank 0 last. Returns -1 if none exist.
+TSFDEF int tsf_get_presetindex_fallback(const tsf* f, int bank, int preset_number, int flag_mididrums);
+
 // Returns the number of presets in the loaded SoundFont
 TSFDEF int tsf_get_presetcount(const tsf* f);
 
@@ -113,6 +180,44 @@ TSFDEF const char* tsf_get_presetname(const tsf* f, int preset_index);
 // Returns the name of a preset by bank and preset number
 TSFDEF const char* tsf_bank_get_presetname(const tsf* f, int bank, int preset_number);
 
+// Ask the OS to start paging in the sample data used by a preset so its first
+// notes don't wait on disk reads. Only has an effect on memory mapped SoundFonts.
+TSFDEF void tsf_prefetch_preset(const tsf* f, int preset_index);
+
+// Read the sample data (and decimated copies) of the regions that the listed presets play on
+// the listed keys once, together with their region lookup entries, so the first notes of them
+// don't page fault. Unlike tsf_prefetch_preset this waits for the reads, run it on a background
+// thread while rendering goes on. Streamed SoundFonts only get their region lookups read, their
+// resident pages stay in memory since loading and the rest streams through the I/O thread.
+//   sets: presets and keys, with all keys bits zero for every key (see tsf_load_subset)
+//   (returns the number of listed presets that exist)
+TSFDEF int tsf_warm_up(const tsf* f, const struct tsf_preset_key_set* sets, int set_count);
+
+// Build band-limited copies of the sample data decimated by 2 (and 4 with mip_levels 2). Notes playing
+// a sample at twice its rate or more then read a copy, which aliases less and reads memory sequentially.
+// Call it right after loading and before tsf_copy, it doesn't work with streamed SoundFonts.
+// Takes 75% more memory than the converted samples with 2 levels.
+//   mip_levels: number of decimated copies, 1 or 2
+//   (returns 0 if the SoundFont is streamed or allocation failed, otherwise 1)
+TSFDEF int tsf_build_mips(tsf* f, int mip_levels);
+
+// Memory tsf_lock_memory could lock into RAM (flags of its return value)
+enum TSFLockedMemory
+{
+	TSF_LOCKED_SAMPLES = 1, // sample data, decimated copies and resident pages of streamed SoundFonts
+	TSF_LOCKED_PRESETS = 2, // presets, regions and their lookup tables
+	TSF_LOCKED_VOICES  = 4  // pre-allocated voices, their lists and controls, channels and stream buffers
+};
+
+// Lock the memory that notes and rendering read into RAM and touch all of it once, so the audio
+// thread doesn't page fault on the first notes. Call it after tsf_set_max_voices, tsf_build_mips
+// and creating the channels, copies made with tsf_copy share the locked samples and presets.
+// Locking needs mmap support and a high enough memory lock limit (RLIMIT_MEMLOCK), memory that
+// couldn't be locked is still touched by writing its bytes back, so call it before any other
+// thread renders or streams with f (including tsf_disk_service).
+//   (returns the TSFLockedMemory flags of what got locked)
+TSFDEF int tsf_lock_memory(tsf* f);
+
 // Supported output modes by the render methods
 enum TSFOutputMode
 {
@@ -164,6 +269,59 @@ TSFDEF void tsf_set_volume(tsf* f, float global_gain);
 //   (tsf_set_max_voices returns 0 if allocation failed, otherwise 1)
 TSFDEF int tsf_set_max_voices(tsf* f, int max_voices);
 
+// Limit the number of voices below the allocated ones, new notes steal voices (see TSFStealPolicy)
+// once this many play. Voices already playing above the limit continue until they end.
+//   voice_limit: maximum number of playing voices or 0 for no limit (default 0)
+TSFDEF void tsf_set_voice_limit(tsf* f, int voice_limit);
+
+// End voices past their attack once their gain (velocity, volume and amplitude envelope) stays below
+// a threshold for a whole render block. Quiet release and sustain tails then stop using CPU.
+//   threshold_db: gain threshold in decibels, for example -80, or 0 to render voices until they end (default 0)
+TSFDEF void tsf_set_cull_threshold(tsf* f, float threshold_db);
+
+// Returns the number of voices ended by the threshold of tsf_set_cull_threshold
+TSFDEF unsigned int tsf_get_culled_voices(const tsf* f);
+
+// Which voice gets stopped for a new one when all voices set by tsf_set_max_voices are playing
+// Voices in their release are always taken before held ones, ties go to the oldest voice.
+enum TSFStealPolicy
+{
+	// The voice that started (or started its release) first (default)
+	TSF_STEAL_OLDEST,
+	// The voice with the lowest gain at note on (velocity, attenuation and channel volume), not the
+	// current level of its envelope
+	TSF_STEAL_QUIETEST,
+	// A voice of the channel with the lowest tsf_channel_set_steal_priority
+	TSF_STEAL_CHANNEL_PRIORITY,
+	// An earlier voice of the same channel and key, otherwise the oldest voice
+	TSF_STEAL_SAME_NOTE
+};
+
+// Set the voice stealing policy
+TSFDEF void tsf_set_steal_policy(tsf* f, enum TSFStealPolicy policy);
+
+// How voices compute the samples between the samples of the SoundFont
+enum TSFInterpolation
+{
+	// Linear interpolation between 2 samples (default)
+	TSF_INTERPOLATION_LINEAR,
+	// Cubic (Catmull-Rom) interpolation over 4 samples
+	TSF_INTERPOLATION_CUBIC,
+	// Windowed sinc interpolation over 8 samples, has the least aliasing and costs the most
+	TSF_INTERPOLATION_SINC,
+	// Sinc for up to TSF_FOCUSVOICES voices of channels set with tsf_channel_set_focus, linear for the others
+	TSF_INTERPOLATION_AUTO
+};
+
+// Set the interpolation of the notes started afterwards
+// (returns 0 if the allocation of the sinc table failed, otherwise 1)
+TSFDEF int tsf_set_interpolation(tsf* f, enum TSFInterpolation interpolation);
+
+// Like tsf_set_interpolation but never allocates, so the audio thread can call it. Sinc and auto
+// need the table created by an earlier tsf_set_interpolation with either of them (tsf_copy gives
+// the copy its own), without it the notes fall back to linear interpolation.
+TSFDEF void tsf_switch_interpolation(tsf* f, enum TSFInterpolation interpolation);
+
 // Start playing a note
 //   preset_index: preset index >= 0 and < tsf_get_presetcount()
 //   key: note value between 0 and 127 (60 being middle C)
@@ -195,6 +353,27 @@ TSFDEF int tsf_active_voice_count(tsf* f);
 TSFDEF void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing CPP_DEFAULT0);
 TSFDEF void tsf_render_float(tsf* f, float* buffer, int samples, int flag_mixing CPP_DEFAULT0);
 
+// Render only the playing voices of one of group_count fixed voice groups, for rendering on
+// several threads. Different groups of the same instance can render at the same time, note
+// on/off and all other calls have to wait until every group is done. Voices that end are only
+// stopped by tsf_render_groups_finish, call it once after all groups of a buffer rendered.
+// Adding up the group buffers in group order gives the same output on any number of threads.
+//   group: group to render >= 0 and < group_count
+//   group_count: number of groups the voices are split into, keep it the same between calls
+TSFDEF void tsf_render_float_group(tsf* f, int group, int group_count, float* buffer, int samples, int flag_mixing CPP_DEFAULT0);
+TSFDEF void tsf_render_groups_finish(tsf* f);
+
+// Render like tsf_render_float, but into bus_count submix buses before adding them up into buffer,
+// so the caller can look at each bus (for example to meter MIDI channels). Voices play into the bus
+// their note was started on, voices of other buses go straight into buffer.
+//   buses: bus_count buffers of samples * output_channels floats one after the other, cleared first
+//   bus_count: number of buses, voices of bus >= bus_count are not kept apart
+TSFDEF void tsf_render_float_buses(tsf* f, float* buffer, float* buses, int bus_count, int samples, int flag_mixing CPP_DEFAULT0);
+
+// Select the bus of tsf_render_float_buses that the next tsf_note_on and tsf_bank_note_on play into
+// (default 0). The tsf_channel_note_on functions always use the channel number as bus.
+TSFDEF void tsf_set_note_bus(tsf* f, int bus);
+
 // Higher level channel based functions, set up channel parameters
 //   channel: channel number
 //   preset_index: preset index >= 0 and < tsf_get_presetcount()
@@ -220,6 +399,12 @@ TSFDEF int tsf_channel_set_pitchrange(tsf* f, int channel, float pitch_range);
 TSFDEF int tsf_channel_set_tuning(tsf* f, int channel, float tuning);
 TSFDEF int tsf_channel_set_sustain(tsf* f, int channel, int flag_sustain);
 
+// Voices of channels with lower priority get stolen first under TSF_STEAL_CHANNEL_PRIORITY (default 0)
+TSFDEF int tsf_channel_set_steal_priority(tsf* f, int channel, int priority);
+
+// Notes of focused channels get high quality interpolation under TSF_INTERPOLATION_AUTO (default 0)
+TSFDEF int tsf_channel_set_focus(tsf* f, int channel, int flag_focus);
+
 // Start or stop playing notes on a channel (needs channel preset to be set)
 //   channel: channel number
 //   key: note value between 0 and 127 (60 being middle C)
@@ -274,6 +459,15 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 // Grace release time for quick voice off (avoid clicking noise)
 #define TSF_FASTRELEASETIME 0.01f
 
+// Decimated copies of the samples built by tsf_build_mips at most, and the taps of their lowpass filter
+#define TSF_MIPLEVELS 2
+#define TSF_MIPTAPS 31
+
+// Number of voices rendered with sinc interpolation at most under TSF_INTERPOLATION_AUTO
+#ifndef TSF_FOCUSVOICES
+#define TSF_FOCUSVOICES 16
+#endif
+
 #if !defined(TSF_MALLOC) || !defined(TSF_FREE) || !defined(TSF_REALLOC)
 #  include <stdlib.h>
 #  define TSF_MALLOC  malloc
@@ -287,7 +481,7 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 #  define TSF_MEMSET  memset
 #endif
 
-#if !defined(TSF_POW) || !defined(TSF_POWF) || !defined(TSF_EXPF) || !defined(TSF_LOG) || !defined(TSF_TAN) || !defined(TSF_LOG10) || !defined(TSF_SQRT)
+#if !defined(TSF_POW) || !defined(TSF_POWF) || !defined(TSF_EXPF) || !defined(TSF_LOG) || !defined(TSF_TAN) || !defined(TSF_SIN) || !defined(TSF_COS) || !defined(TSF_LOG10) || !defined(TSF_SQRT)
 #  include <math.h>
 #  if !defined(__cplusplus) && !defined(NAN) && !defined(powf) && !defined(expf) && !defined(sqrtf)
 #    define powf (float)pow // deal with old math.h
@@ -299,14 +493,64 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 #  define TSF_EXPF    expf
 #  define TSF_LOG     log
 #  define TSF_TAN     tan
+#  define TSF_SIN     sin
+#  define TSF_COS     cos
 #  define TSF_LOG10   log10
 #  define TSF_SQRTF   sqrtf
 #endif
 
+#if !defined(TSF_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#  include <xmmintrin.h>
+#  define TSF_SSE
+#elif !defined(TSF_NO_SIMD) && defined(__aarch64__)
+#  include <arm_neon.h>
+#  define TSF_NEON
+#endif
+
 #ifndef TSF_NO_STDIO
 #  include <stdio.h>
 #endif
 
+#if !defined(TSF_NO_STDIO) && !defined(TSF_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#  include <sys/mman.h>
+#  ifdef MADV_WILLNEED // not available with strict ISO C compiler flags
+#    define TSF_HAS_MMAP
+#    include <sys/stat.h>
+#    include <fcntl.h>
+#    include <unistd.h>
+#  endif
+#endif
+
+#ifndef TSF_NO_STDIO
+#  ifdef _MSC_VER
+#    define TSF_FSEEK(f, pos) _fseeki64(f, (__int64)(pos), SEEK_SET)
+#    define TSF_FTELL(f) _ftelli64(f)
+#  else // long is 32-bit on 32-bit platforms, streaming is then limited to files below 2 GB
+#    define TSF_FSEEK(f, pos) fseek(f, (long)(pos), SEEK_SET)
+#    define TSF_FTELL(f) ftell(f)
+#  endif
+#endif
+
+// Streaming voices hand their state between the audio and the I/O thread with these,
+// voice groups rendered on several threads count streaming underruns with TSF_ATOMIC_INC
+#if defined(__GNUC__) || defined(__clang__)
+#  define TSF_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#  define TSF_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#  define TSF_ATOMIC_CAS(p, expected, desired) __sync_bool_compare_and_swap((p), (expected), (desired))
+#  define TSF_ATOMIC_INC(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#elif defined(_MSC_VER)
+#  include <intrin.h>
+#  define TSF_ATOMIC_LOAD(p) (*(volatile int*)(p)) // volatile has acquire/release semantics with MSVC
+#  define TSF_ATOMIC_STORE(p, v) (*(volatile int*)(p) = (v))
+#  define TSF_ATOMIC_CAS(p, expected, desired) (_InterlockedCompareExchange((volatile long*)(p), (desired), (expected)) == (expected))
+#  define TSF_ATOMIC_INC(p) _InterlockedIncrement((volatile long*)(p))
+#else // only safe with note on/off and rendering on the same thread
+#  define TSF_ATOMIC_LOAD(p) (*(volatile int*)(p))
+#  define TSF_ATOMIC_STORE(p, v) (*(volatile int*)(p) = (v))
+#  define TSF_ATOMIC_CAS(p, expected, desired) (*(p) == (expected) ? (*(p) = (desired), 1) : 0)
+#  define TSF_ATOMIC_INC(p) (++*(p))
+#endif
+
 #define TSF_TRUE 1
 #define TSF_FALSE 0
 #define TSF_BOOL unsigned char
@@ -325,24 +569,82 @@ typedef signed short tsf_s16;
 typedef unsigned int tsf_u32;
 typedef char tsf_char20[20];
 
+// Number of lists voices of exclusive groups are kept in, voices with different groups can share one
+#define TSF_GROUPLISTS 64
+
 #define TSF_FourCCEquals(value1, value2) (value1[0] == value2[0] && value1[1] == value2[1] && value1[2] == value2[2] && value1[3] == value2[3])
 
+// Control rate state of the voices kept as arrays indexed like tsf::voices. Every block the
+// render functions update the controls of all voices in a pass of their own, then the sample
+// loops read the gains, pitch ratios and filter coefficients of a voice from here.
+enum { TSF_CONTROL_LOWPASS = 1, TSF_CONTROL_PITCH = 2, TSF_CONTROL_GAIN = 4, TSF_CONTROL_MODENV = 8 };
+struct tsf_voice_controls
+{
+	unsigned char* flags; // TSF_CONTROL_* of the things modulated per block
+	unsigned char* lowpassActive;
+	float *gainLeft, *gainRight, *noteGain; // gainLeft is the only gain with TSF_MONO
+	double *pitchRatio, *lowpassA0, *lowpassA1, *lowpassB1, *lowpassB2;
+	float *modLfoLevel, *modLfoDelta, *vibLfoLevel, *vibLfoDelta;
+	int *modLfoUntil, *vibLfoUntil;
+
+	// Modulation amounts copied from the region at note on
+	float *initialFilterFc, *modLfoToFilterFc, *modEnvToFilterFc;
+	float *modLfoToPitch, *vibLfoToPitch, *modEnvToPitch, *modLfoToVolume;
+};
+
 struct tsf
 {
 	struct tsf_preset* presets;
 	float* fontSamples;
+	const short* fontSamples16;
+	float* mipSamples[TSF_MIPLEVELS]; // samples decimated by 2, 4, ... of tsf_build_mips
+	int mipLevels;
+	struct tsf_disk* disk;
 	struct tsf_voice* voices;
+	int* activeVoices; // indices of the playing voices in no particular order
+	int* keyVoices; // heads of the voice lists per channel (first for voices without channel) and key
+	int* presetHash; // open addressing table of preset index + 1 by bank and preset number
+	int* stealHeap; // indices of the playing voices, the next voice to steal first
 	struct tsf_channels* channels;
+	struct tsf_voice_controls controls;
+	float* sincTable; // coefficients of sinc interpolation, only allocated when used
 
 	int presetNum;
+	int presetHashMask;
+	unsigned int fontSampleCount;
 	int voiceNum;
 	int maxVoiceNum;
+	int voiceLimit; // soft limit of tsf_set_voice_limit, 0 if there is none
+	float cullGain; // gain of tsf_set_cull_threshold, 0 if disabled
+	unsigned int culledVoices; // voice groups rendered on several threads count it with TSF_ATOMIC_INC
+	int noteBus; // bus of tsf_set_note_bus
+	int activeVoiceNum;
+	int freeVoice; // index + 1 of the first voice in the free list, 0 if there is none
+	int keyVoiceChannelNum;
+	int stealHeapNum;
+	enum TSFStealPolicy stealPolicy;
+	enum TSFInterpolation interpolation;
+	int focusVoiceNum; // voices with sinc interpolation under TSF_INTERPOLATION_AUTO
+	unsigned int voiceStealIndex;
+	int groupVoices[TSF_GROUPLISTS]; // heads of the voice lists per exclusive group (hashed)
 	unsigned int voicePlayIndex;
 
 	enum TSFOutputMode outputmode;
 	float outSampleRate;
 	float globalGainDB;
 	int* refCount;
+
+	int samplesCompacted;
+
+	// Presets, regions and samples loaded from a cache file all point into this block
+	void* cacheBase;
+	size_t cacheSize;
+	int cacheMapped;
+
+	#ifdef TSF_HAS_MMAP
+	void* mapBase;
+	size_t mapSize;
+	#endif
 };
 
 #ifndef TSF_NO_STDIO
@@ -382,6 +684,98 @@ TSFDEF tsf* tsf_load_memory(const void* buffer, int size)
 	return tsf_load(&stream);
 }
 
+static tsf* tsf_load_internal(struct tsf_stream* stream, struct tsf_stream_memory* in_place, const struct tsf_preset_key_set* subset, int subsetNum, tsf_u32* deferredSmplPos);
+static int tsf_load_subset_samples(tsf* res, const float* srcFloat, const short* src16, unsigned int srcCount);
+
+#ifdef TSF_HAS_MMAP
+static void tsf_madvise(const void* ptr, size_t size, int advice)
+{
+	// madvise wants a page aligned start address, extend the range down to the page boundary
+	size_t page = (size_t)sysconf(_SC_PAGESIZE), misalign = (size_t)ptr & (page - 1);
+	madvise((char*)ptr - misalign, size + misalign, advice);
+}
+
+static tsf* tsf_load_mapped(const char* filename, const struct tsf_preset_key_set* subset, int subsetNum, void** pMap, size_t* pMapSize)
+{
+	tsf* res;
+	struct stat st;
+	void* map;
+	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_memory_read, (int(*)(void*,unsigned int))&tsf_stream_memory_skip };
+	struct tsf_stream_memory m = { 0, 0, 0 };
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return TSF_NULL;
+	if (fstat(fd, &st) || st.st_size <= 0 || (unsigned long long)st.st_size > 0xFFFFFFFFu) { close(fd); return TSF_NULL; }
+	map = mmap(TSF_NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping stays valid without the descriptor
+	if (map == MAP_FAILED) return TSF_NULL;
+
+	// Sample data should only be paged in for what is played or prefetched, so no read-ahead
+	// through the whole file. The hydra chunks are requested separately while loading.
+	tsf_madvise(map, (size_t)st.st_size, MADV_RANDOM);
+	m.buffer = (const char*)map;
+	m.total = (unsigned int)st.st_size;
+	stream.data = &m;
+	res = tsf_load_internal(&stream, &m, subset, subsetNum, TSF_NULL);
+	if (!res || !res->fontSamples16)
+	{
+		// Nothing references the mapping (failed or samples got decoded into memory)
+		munmap(map, (size_t)st.st_size);
+		*pMap = TSF_NULL;
+		return res;
+	}
+	*pMap = map;
+	*pMapSize = (size_t)st.st_size;
+	return res;
+}
+
+TSFDEF tsf* tsf_load_filename_mapped(const char* filename)
+{
+	void* map; size_t mapSize;
+	tsf* res = tsf_load_mapped(filename, TSF_NULL, 0, &map, &mapSize);
+	if (res && map) { res->mapBase = map; res->mapSize = mapSize; }
+	return res;
+}
+
+TSFDEF tsf* tsf_load_filename_subset(const char* filename, const struct tsf_preset_key_set* needed, int needed_count)
+{
+	void* map; size_t mapSize;
+	tsf* res = tsf_load_mapped(filename, needed, needed_count, &map, &mapSize);
+	if (res && map)
+	{
+		// Convert the used parts of the mapped samples, this only pages in what the subset plays
+		if (!tsf_load_subset_samples(res, TSF_NULL, res->fontSamples16, res->fontSampleCount))
+		{
+			tsf_close(res);
+			res = TSF_NULL;
+		}
+		else res->fontSamples16 = TSF_NULL;
+		munmap(map, mapSize);
+	}
+	return res;
+}
+#elif !defined(TSF_NO_STDIO)
+TSFDEF tsf* tsf_load_filename_mapped(const char* filename)
+{
+	return tsf_load_filename(filename);
+}
+
+TSFDEF tsf* tsf_load_filename_subset(const char* filename, const struct tsf_preset_key_set* needed, int needed_count)
+{
+	tsf* res;
+	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_stdio_read, (int(*)(void*,unsigned int))&tsf_stream_stdio_skip };
+	#if __STDC_WANT_SECURE_LIB__
+	FILE* f = TSF_NULL; fopen_s(&f, filename, "rb");
+	#else
+	FILE* f = fopen(filename, "rb");
+	#endif
+	if (!f) return TSF_NULL;
+	stream.data = f;
+	res = tsf_load_subset(&stream, needed, needed_count);
+	fclose(f);
+	return res;
+}
+#endif
+
 enum { TSF_LOOPMODE_NONE, TSF_LOOPMODE_CONTINUOUS, TSF_LOOPMODE_SUSTAIN };
 
 enum { TSF_SEGMENT_NONE, TSF_SEGMENT_DELAY, TSF_SEGMENT_ATTACK, TSF_SEGMENT_HOLD, TSF_SEGMENT_DECAY, TSF_SEGMENT_SUSTAIN, TSF_SEGMENT_RELEASE, TSF_SEGMENT_DONE };
@@ -419,9 +813,8 @@ static void tsf_hydra_read_shdr(struct tsf_hydra_shdr* i, struct tsf_stream* str
 
 struct tsf_riffchunk { tsf_fourcc id; tsf_u32 size; };
 struct tsf_envelope { float delay, attack, hold, decay, sustain, release, keynumToHold, keynumToDecay; };
-struct tsf_voice_envelope { unsigned char segment, segmentIsExponential : 1, isAmpEnv : 1; short midiVelocity; float level, slope; int samplesUntilNextSegment; struct tsf_envelope parameters; };
-struct tsf_voice_lowpass { double QInv, a0, a1, b1, b2, z1, z2; TSF_BOOL active; };
-struct tsf_voice_lfo { int samplesUntil; float level, delta; };
+struct tsf_voice_envelope { unsigned char segment, segmentIsExponential : 1, isAmpEnv : 1; short midiVelocity; float level, slope, blockSlope; int samplesUntilNextSegment; struct tsf_envelope parameters; };
+struct tsf_voice_lowpass { double a0, a1, b1, b2, z1, z2; TSF_BOOL active; };
 
 struct tsf_region
 {
@@ -440,31 +833,56 @@ struct tsf_region
 	int freqVibLFO, vibLfoToPitch;
 };
 
+// Regions of a preset bucketed by key and velocity layer. The velocity layers are the ranges
+// between all distinct lovel/hivel boundaries of the preset so a whole layer matches the same
+// regions. Bucket (key * layerNum + layer) plays regions[index[start[bucket]..start[bucket+1]-1]].
+struct tsf_region_lookup
+{
+	unsigned char layer[128];
+	int layerNum;
+	int *start, *index;
+};
+
 struct tsf_preset
 {
 	tsf_char20 presetName;
 	tsf_u16 preset, bank;
 	struct tsf_region* regions;
 	int regionNum;
+	struct tsf_region_lookup* lookup;
 };
 
+struct tsf_voice_kernel_state;
+typedef void (*tsf_voice_kernel)(struct tsf_voice_kernel_state* s, float* outL, float* outR, int blockSamples);
+
 struct tsf_voice
 {
 	int playingPreset, playingKey, playingChannel, heldSustain;
+	int bus; // submix bus of tsf_render_float_buses
 	struct tsf_region* region;
+	struct tsf_disk_slot* diskSlot;
+	int activeIndex, nextFree; // position in the active list or index + 1 of the next free voice
+	int keyList, keyPrev, keyNext, groupPrev, groupNext; // links are index + 1, 0 ends the list
+	int heapIndex; // position in the steal heap
+	int finished; // ended during group rendering and waiting for tsf_render_groups_finish
+	int releasedInRender; // envelope went into release while rendering, tsf_render_groups_finish moves it in the steal heap
+	int focused; // counted in tsf::focusVoiceNum
+	int mipLevel; // plays tsf::mipSamples[mipLevel - 1] if not 0, positions and loop are in its samples
+	unsigned int stealIndex; // order of note on, or of the release once released
 	double pitchInputTimecents, pitchOutputFactor;
 	double sourceSamplePosition;
 	float  noteGainDB, panFactorLeft, panFactorRight;
 	unsigned int playIndex, loopStart, loopEnd;
 	struct tsf_voice_envelope ampenv, modenv;
-	struct tsf_voice_lowpass lowpass;
-	struct tsf_voice_lfo modlfo, viblfo;
+	double lowpassQInv, lowpassZ1, lowpassZ2; // the coefficients are in tsf::controls
+	const tsf_voice_kernel (*kernels)[2]; // [outputmode][lowpass active] sample loops for the source and looping
 };
 
 struct tsf_channel
 {
-	unsigned short presetIndex, bank, pitchWheel, midiPan, midiVolume, midiExpression, midiRPN, midiData : 14, sustain : 1;
+	unsigned short presetIndex, bank, pitchWheel, midiPan, midiVolume, midiExpression, midiRPN, midiData : 14, sustain : 1, focus : 1;
 	float panOffset, gainDB, pitchRange, tuning;
+	int stealPriority;
 };
 
 struct tsf_channels
@@ -480,6 +898,35 @@ static float tsf_cents2Hertz(float cents) { return 8.176f * TSF_POWF(2.0f, cents
 static float tsf_decibelsToGain(float db) { return (db > -100.f ? TSF_POWF(10.0f, db * 0.05f) : 0); }
 static float tsf_gainToDecibels(float gain) { return (gain <= .00001f ? -100.f : (float)(20.0 * TSF_LOG10(gain))); }
 
+// Approximations for the conversions done per block while rendering modulated voices.
+// 2^x puts the integer nearest to x straight into the exponent bits and evaluates the remainder
+// in [-0.5, 0.5] with a degree 7 polynomial, the relative error stays below 1e-8.
+static double tsf_fastExp2(double x)
+{
+	double n, r, scale; unsigned long long bits;
+	if (x < -1000.0) return 0;
+	if (x > 1000.0) x = 1000.0;
+	n = (double)(int)(x < 0 ? x - 0.5 : x + 0.5);
+	r = (x - n) * 0.69314718055994531;
+	bits = (unsigned long long)((int)n + 1023) << 52;
+	TSF_MEMCPY(&scale, &bits, sizeof(scale));
+	return scale * (1 + r * (1 + r * (1 / 2.0 + r * (1 / 6.0 + r * (1 / 24.0 + r * (1 / 120.0 + r * (1 / 720.0 + r * (1 / 5040.0))))))));
+}
+static float tsf_fastCents2Hertz(float cents) { return 8.176f * (float)tsf_fastExp2(cents / 1200.0); }
+static float tsf_fastDecibelsToGain(float db) { return (db > -100.f ? (float)tsf_fastExp2(db * 0.16609640474436813) : 0); } // 10^(db/20)
+
+// tan(x) for 0 <= x < pi/2 with a Pade approximant on [0, pi/4] and tan(x) = 1 / tan(pi/2 - x)
+// above it, the relative error stays below 2e-8.
+static double tsf_fastTan(double x)
+{
+	TSF_BOOL invert = (x > TSF_PI / 4);
+	double xx, t;
+	if (invert) x = TSF_PI / 2 - x;
+	xx = x * x;
+	t = x * (945 - 105 * xx + xx * xx) / (945 - 420 * xx + 15 * xx * xx);
+	return (invert ? 1 / t : t);
+}
+
 static TSF_BOOL tsf_riffchunk_read(struct tsf_riffchunk* parent, struct tsf_riffchunk* chunk, struct tsf_stream* stream)
 {
 	TSF_BOOL IsRiff, IsList;
@@ -705,13 +1152,31 @@ static void tsf_region_envtosecs(struct tsf_envelope* p, TSF_BOOL sustainIsGain)
 	else p->sustain = 1.0f - (p->sustain / 1000.0f);
 }
 
-static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int fontSampleCount)
+static const struct tsf_preset_key_set* tsf_subset_find(const struct tsf_preset_key_set* subset, int subsetNum, tsf_u16 bank, tsf_u16 preset)
+{
+	for (; subsetNum--; subset++) if (subset->bank == bank && subset->preset_number == preset) return subset;
+	return TSF_NULL;
+}
+
+static TSF_BOOL tsf_subset_has_keys(const struct tsf_preset_key_set* entry, unsigned char lokey, unsigned char hikey)
+{
+	int key;
+	if (!(entry->keys[0] | entry->keys[1] | entry->keys[2] | entry->keys[3])) return TSF_TRUE;
+	for (key = lokey; key <= hikey && key < 128; key++)
+		if (entry->keys[key >> 5] & (1u << (key & 31))) return TSF_TRUE;
+	return TSF_FALSE;
+}
+
+static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int fontSampleCount, const struct tsf_preset_key_set* subset, int subsetNum)
 {
 	enum { GenInstrument = 41, GenKeyRange = 43, GenVelRange = 44, GenSampleID = 53 };
 	// Read each preset.
 	struct tsf_hydra_phdr *pphdr, *pphdrMax;
-	res->presetNum = hydra->phdrNum - 1;
-	res->presets = (struct tsf_preset*)TSF_MALLOC(res->presetNum * sizeof(struct tsf_preset));
+	#define TSF_SUBSET_SKIP(phdr) (subset && !tsf_subset_find(subset, subsetNum, (phdr)->bank, (phdr)->preset))
+	res->presetNum = 0;
+	for (pphdr = hydra->phdrs, pphdrMax = pphdr + hydra->phdrNum - 1; pphdr != pphdrMax; pphdr++)
+		if (!TSF_SUBSET_SKIP(pphdr)) res->presetNum++;
+	res->presets = (struct tsf_preset*)TSF_MALLOC((res->presetNum ? res->presetNum : 1) * sizeof(struct tsf_preset));
 	if (!res->presets) return 0;
 	else { int i; for (i = 0; i != res->presetNum; i++) res->presets[i].regions = TSF_NULL; }
 	for (pphdr = hydra->phdrs, pphdrMax = pphdr + hydra->phdrNum - 1; pphdr != pphdrMax; pphdr++)
@@ -721,9 +1186,10 @@ static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int font
 		struct tsf_preset* preset;
 		struct tsf_hydra_pbag *ppbag, *ppbagEnd;
 		struct tsf_region globalRegion;
+		if (TSF_SUBSET_SKIP(pphdr)) continue;
 		for (otherphdr = hydra->phdrs; otherphdr != pphdrMax; otherphdr++)
 		{
-			if (otherphdr == pphdr || otherphdr->bank > pphdr->bank) continue;
+			if (otherphdr == pphdr || otherphdr->bank > pphdr->bank || TSF_SUBSET_SKIP(otherphdr)) continue;
 			else if (otherphdr->bank < pphdr->bank) sortedIndex++;
 			else if (otherphdr->preset > pphdr->preset) continue;
 			else if (otherphdr->preset < pphdr->preset) sortedIndex++;
@@ -860,9 +1326,340 @@ static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int font
 			if (ppbag == hydra->pbags + pphdr->presetBagNdx && !hadGenInstrument)
 				globalRegion = presetRegion;
 		}
+
+		// Drop the regions of keys that won't be played
+		if (subset)
+		{
+			const struct tsf_preset_key_set* entry = tsf_subset_find(subset, subsetNum, pphdr->bank, pphdr->preset);
+			struct tsf_region *src, *dst, *srcEnd;
+			for (src = dst = preset->regions, srcEnd = src + preset->regionNum; src != srcEnd; src++)
+				if (tsf_subset_has_keys(entry, src->lokey, src->hikey)) *dst++ = *src;
+			preset->regionNum = (int)(dst - preset->regions);
+		}
+	}
+	#undef TSF_SUBSET_SKIP
+	return 1;
+}
+
+static struct tsf_region_lookup* tsf_load_region_lookup(const struct tsf_preset* preset)
+{
+	struct tsf_region_lookup *lookup, *grown;
+	const struct tsf_region *region, *regionEnd = preset->regions + preset->regionNum;
+	unsigned char boundary[128];
+	int vel, layerNum, bucketNum, key, layer, i;
+
+	// A new layer starts at every lovel and right after every hivel
+	TSF_MEMSET(boundary, 0, sizeof(boundary));
+	for (region = preset->regions; region != regionEnd; region++)
+	{
+		if (region->lovel > 127 || region->lovel > region->hivel) continue;
+		boundary[region->lovel] = 1;
+		if (region->hivel < 127) boundary[region->hivel + 1] = 1;
+	}
+	for (layerNum = 1, vel = 1; vel != 128; vel++) layerNum += boundary[vel];
+	bucketNum = 128 * layerNum;
+
+	#define TSF_LOOKUP_FOREACH_BUCKET \
+		if (region->lokey <= 127 && region->lokey <= region->hikey && region->lovel <= 127 && region->lovel <= region->hivel) \
+			for (key = region->lokey; key <= region->hikey && key != 128; key++) \
+				for (layer = lookup->layer[region->lovel]; layer <= lookup->layer[region->hivel < 127 ? region->hivel : 127]; layer++)
+
+	// Count the regions of each bucket first to size the index array
+	lookup = (struct tsf_region_lookup*)TSF_MALLOC(sizeof(struct tsf_region_lookup) + (bucketNum + 1) * sizeof(int));
+	if (!lookup) return TSF_NULL;
+	lookup->layerNum = layerNum;
+	lookup->start = (int*)(lookup + 1);
+	for (layer = 0, vel = 0; vel != 128; vel++) lookup->layer[vel] = (unsigned char)(layer += (vel && boundary[vel]));
+	TSF_MEMSET(lookup->start, 0, (bucketNum + 1) * sizeof(int));
+	for (region = preset->regions; region != regionEnd; region++)
+		TSF_LOOKUP_FOREACH_BUCKET lookup->start[key * layerNum + layer + 1]++;
+	for (i = 0; i != bucketNum; i++) lookup->start[i + 1] += lookup->start[i];
+
+	// Fill the buckets in region order so a note starts its voices in the same order as a full scan,
+	// start[bucket] serves as the fill position and ends up at the start of the next bucket
+	grown = (struct tsf_region_lookup*)TSF_REALLOC(lookup, sizeof(struct tsf_region_lookup) + (bucketNum + 1 + lookup->start[bucketNum]) * sizeof(int));
+	if (!grown) { TSF_FREE(lookup); return TSF_NULL; }
+	lookup = grown;
+	lookup->start = (int*)(lookup + 1);
+	lookup->index = lookup->start + bucketNum + 1;
+	for (region = preset->regions; region != regionEnd; region++)
+		TSF_LOOKUP_FOREACH_BUCKET lookup->index[lookup->start[key * layerNum + layer]++] = (int)(region - preset->regions);
+	for (i = bucketNum; i; i--) lookup->start[i] = lookup->start[i - 1];
+	lookup->start[0] = 0;
+	#undef TSF_LOOKUP_FOREACH_BUCKET
+	return lookup;
+}
+
+static int tsf_load_region_lookups(tsf* res)
+{
+	int i;
+	for (i = 0; i != res->presetNum; i++)
+	{
+		res->presets[i].lookup = tsf_load_region_lookup(&res->presets[i]);
+		if (!res->presets[i].lookup)
+		{
+			while (i--) { TSF_FREE(res->presets[i].lookup); res->presets[i].lookup = TSF_NULL; }
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#define TSF_PRESETHASH(bank, preset_number) ((((tsf_u32)(bank) << 16 | (tsf_u32)(preset_number)) * 2654435769u) >> 16)
+
+static int tsf_load_preset_hash(tsf* res)
+{
+	int i, slot, size = 8;
+	while (size < res->presetNum * 2) size <<= 1;
+	res->presetHash = (int*)TSF_MALLOC(size * sizeof(int));
+	if (!res->presetHash) return 0;
+	TSF_MEMSET(res->presetHash, 0, size * sizeof(int));
+	res->presetHashMask = size - 1;
+	for (i = 0; i != res->presetNum; i++)
+	{
+		// Keep the first of duplicate presets like the linear search did
+		const struct tsf_preset *preset = &res->presets[i], *other;
+		for (slot = TSF_PRESETHASH(preset->bank, preset->preset) & res->presetHashMask; res->presetHash[slot]; slot = (slot + 1) & res->presetHashMask)
+		{
+			other = &res->presets[res->presetHash[slot] - 1];
+			if (other->bank == preset->bank && other->preset == preset->preset) break;
+		}
+		if (!res->presetHash[slot]) res->presetHash[slot] = i + 1;
+	}
+	return 1;
+}
+
+static int tsf_load_subset_samples(tsf* res, const float* srcFloat, const short* src16, unsigned int srcCount)
+{
+	// Gather the sample range each region can read, sort them and merge overlapping ones into
+	// blocks that get copied next to each other into a new compact sample buffer.
+	struct tsf_sample_range { unsigned int start, end; struct tsf_region* region; } *ranges, tmp;
+	struct tsf_preset *preset, *presetEnd = res->presets + res->presetNum;
+	struct tsf_region *region, *regionEnd;
+	unsigned int blockStart = 0, blockEnd = 0, blockTarget = 0, total;
+	int rangeNum = 0, i, j, gap;
+	float* out;
+
+	for (preset = res->presets; preset != presetEnd; preset++) rangeNum += preset->regionNum;
+	ranges = (struct tsf_sample_range*)TSF_MALLOC((rangeNum ? rangeNum : 1) * sizeof(struct tsf_sample_range));
+	if (!ranges) return 0;
+	for (rangeNum = 0, preset = res->presets; preset != presetEnd; preset++)
+	{
+		for (region = preset->regions, regionEnd = region + preset->regionNum; region != regionEnd; region++)
+		{
+			// Playback reads from offset up to and including end (the interpolation looks one ahead)
+			unsigned int start = (region->end < region->offset ? region->end : region->offset), end = region->end + 1;
+			if (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end)
+			{
+				if (region->loop_start < start) start = region->loop_start;
+				if (region->loop_end + 1 > end) end = region->loop_end + 1;
+			}
+			else region->loop_start = region->loop_end = 0; // unused, don't let them point outside the new buffer
+			if (end > srcCount) end = srcCount;
+			if (start >= end) { region->offset = region->end = region->loop_start = region->loop_end = 0; continue; }
+			ranges[rangeNum].start = start;
+			ranges[rangeNum].end = end;
+			ranges[rangeNum].region = region;
+			rangeNum++;
+		}
+	}
+
+	for (gap = rangeNum / 2; gap > 0; gap /= 2)
+		for (i = gap; i < rangeNum; i++)
+			for (tmp = ranges[i], j = i; j >= gap && ranges[j - gap].start > tmp.start; j -= gap)
+				ranges[j] = ranges[j - gap], ranges[j - gap] = tmp;
+
+	// Count the merged size first (plus one sample of zero padding for the interpolation at the very end)
+	for (total = 0, i = 0; i != rangeNum; i++)
+	{
+		if (i && ranges[i].start <= blockEnd) { if (ranges[i].end > blockEnd) { total += ranges[i].end - blockEnd; blockEnd = ranges[i].end; } }
+		else { total += ranges[i].end - ranges[i].start; blockEnd = ranges[i].end; }
+	}
+	out = (float*)TSF_MALLOC((total + 1) * sizeof(float));
+	if (!out) { TSF_FREE(ranges); return 0; }
+	out[total] = 0.0f;
+
+	for (i = 0; i != rangeNum; i++)
+	{
+		unsigned int from, to, shift;
+		if (i && ranges[i].start <= blockEnd)
+		{
+			if (ranges[i].end <= blockEnd) from = to = 0;
+			else from = blockEnd, to = blockEnd = ranges[i].end;
+		}
+		else
+		{
+			if (i) blockTarget += blockEnd - blockStart;
+			from = blockStart = ranges[i].start;
+			to = blockEnd = ranges[i].end;
+		}
+		if (src16) { const short* in = src16 + from; float* o = out + blockTarget + (from - blockStart); for (; from != to; from++) *(o++) = (float)(*(in++) / 32767.0); }
+		else if (from != to) TSF_MEMCPY(out + blockTarget + (from - blockStart), srcFloat + from, (to - from) * sizeof(float));
+
+		// Move the region into the block
+		region = ranges[i].region;
+		shift = blockStart - blockTarget;
+		region->offset -= shift;
+		region->end -= shift;
+		if (region->loop_start < region->loop_end) { region->loop_start -= shift; region->loop_end -= shift; }
+	}
+	TSF_FREE(ranges);
+
+	TSF_FREE(res->fontSamples);
+	res->fontSamples = out;
+	res->fontSampleCount = total;
+	res->samplesCompacted = 1;
+	return 1;
+}
+
+// Streamed samples are addressed in pages, resident pages are kept in memory for the whole time
+#define TSF_DISK_PAGEBITS 12
+#define TSF_DISK_PAGESIZE (1 << TSF_DISK_PAGEBITS)
+#define TSF_DISK_READSIZE 4096
+
+enum { TSF_DISK_IDLE, TSF_DISK_CLAIMED, TSF_DISK_ACTIVE, TSF_DISK_RELEASED };
+
+struct tsf_disk_slot
+{
+	// The audio thread claims an idle slot and releases it, the I/O thread makes it idle again
+	int state;
+	// Number of samples read by the I/O thread and the position reached by the voice (relative to start)
+	int filled, consumed;
+	unsigned int start, stop;
+	float* ring;
+};
+
+struct tsf_disk
+{
+	void* file;
+	tsf_u32 smplPos;
+	unsigned int sampleCount, pageNum, ringMask, underruns;
+	float **pages, *pageData, *ringData;
+	short* readBuffer;
+	struct tsf_disk_slot* slots;
+	int slotNum;
+};
+
+static float tsf_disk_sample(struct tsf_disk* d, const struct tsf_disk_slot* s, int filled, unsigned int pos, int* missed)
+{
+	const float* page = d->pages[pos >> TSF_DISK_PAGEBITS];
+	if (page) return page[pos & (TSF_DISK_PAGESIZE - 1)];
+	// The ring holds the last ringMask + 1 samples read, anything older was overwritten
+	if (s && pos - s->start < (unsigned int)filled && (unsigned int)filled - (pos - s->start) <= d->ringMask + 1) return s->ring[pos & d->ringMask];
+	*missed = 1; // not read in time, play silence instead of waiting for it (counted once per block)
+	return 0.0f;
+}
+
+static struct tsf_disk_slot* tsf_disk_claim(struct tsf_disk* d, const struct tsf_region* region)
+{
+	unsigned int pos = region->offset, stop = (region->end < d->sampleCount ? region->end + 1 : d->sampleCount);
+	int i;
+
+	// Find the first position the voice will read that isn't resident
+	while (pos < stop && d->pages[pos >> TSF_DISK_PAGEBITS]) pos = (pos | (TSF_DISK_PAGESIZE - 1)) + 1;
+	if (pos >= stop) return TSF_NULL;
+
+	for (i = 0; i != d->slotNum; i++)
+	{
+		struct tsf_disk_slot* s = d->slots + i;
+		if (!TSF_ATOMIC_CAS(&s->state, TSF_DISK_IDLE, TSF_DISK_CLAIMED)) continue;
+		s->start = pos;
+		s->stop = stop;
+		s->filled = s->consumed = 0;
+		TSF_ATOMIC_STORE(&s->state, TSF_DISK_ACTIVE);
+		return s;
+	}
+	return TSF_NULL; // all slots in use, the voice plays its resident part followed by silence
+}
+
+static void tsf_disk_free(struct tsf_disk* d)
+{
+	if (!d) return;
+	#ifndef TSF_NO_STDIO
+	if (d->file) fclose((FILE*)d->file);
+	#endif
+	TSF_FREE(d->pages); TSF_FREE(d->pageData); TSF_FREE(d->ringData);
+	TSF_FREE(d->readBuffer); TSF_FREE(d->slots);
+	TSF_FREE(d);
+}
+
+#if !defined(TSF_NO_STDIO) && !defined(STB_VORBIS_INCLUDE_STB_VORBIS_H)
+static void tsf_disk_read(struct tsf_disk* d, float* out, unsigned int pos, int num)
+{
+	int i, got = 0;
+	if (pos < d->sampleCount && !TSF_FSEEK((FILE*)d->file, d->smplPos + (size_t)pos * sizeof(short)))
+	{
+		if ((unsigned int)num > d->sampleCount - pos) got = (int)(d->sampleCount - pos);
+		else got = num;
+		got = (int)fread(d->readBuffer, sizeof(short), (size_t)got, (FILE*)d->file);
+	}
+	for (i = 0; i != got; i++) out[i] = (float)(d->readBuffer[i] / 32767.0);
+	for (; i < num; i++) out[i] = 0.0f;
+}
+
+static void tsf_disk_mark(struct tsf_disk* d, unsigned int from, unsigned int to)
+{
+	unsigned int page = from >> TSF_DISK_PAGEBITS, pageLast = to >> TSF_DISK_PAGEBITS;
+	if (pageLast >= d->pageNum) pageLast = d->pageNum - 1;
+	for (; page <= pageLast; page++) d->pages[page] = (float*)d; // non-null marker, replaced with the data below
+}
+
+static int tsf_disk_setup(tsf* res, FILE* file, tsf_u32 smplPos, int resident_ms, int max_streams, int buffer_ms)
+{
+	struct tsf_preset *preset, *presetEnd = res->presets + res->presetNum;
+	struct tsf_region *region, *regionEnd;
+	unsigned int i, residentNum = 0, ringSize = TSF_DISK_READSIZE * 2, ringMin;
+	float maxSampleRate = 44100.0f, *page;
+	struct tsf_disk* d = (struct tsf_disk*)TSF_MALLOC(sizeof(struct tsf_disk));
+	if (!d) return 0;
+	TSF_MEMSET(d, 0, sizeof(struct tsf_disk));
+	d->file = file;
+	d->smplPos = smplPos;
+	d->sampleCount = res->fontSampleCount;
+	d->pageNum = (res->fontSampleCount >> TSF_DISK_PAGEBITS) + 1;
+	res->disk = d; // owned by res from here on
+
+	d->pages = (float**)TSF_MALLOC(d->pageNum * sizeof(float*));
+	d->readBuffer = (short*)TSF_MALLOC((TSF_DISK_PAGESIZE > TSF_DISK_READSIZE ? TSF_DISK_PAGESIZE : TSF_DISK_READSIZE) * sizeof(short));
+	if (!d->pages || !d->readBuffer) return 0;
+	TSF_MEMSET(d->pages, 0, d->pageNum * sizeof(float*));
+
+	// Keep the start of each region resident, and its loop because voices can stay in it indefinitely
+	for (preset = res->presets; preset != presetEnd; preset++)
+	{
+		for (region = preset->regions, regionEnd = region + preset->regionNum; region != regionEnd; region++)
+		{
+			unsigned int residentEnd = region->offset + (unsigned int)(resident_ms * (double)region->sample_rate / 1000.0);
+			tsf_disk_mark(d, region->offset, (residentEnd < region->end ? residentEnd : region->end));
+			if (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end)
+				tsf_disk_mark(d, region->loop_start, region->loop_end + 1);
+			if (region->sample_rate > maxSampleRate) maxSampleRate = (float)region->sample_rate;
+		}
+	}
+	for (i = 0; i != d->pageNum; i++) if (d->pages[i]) residentNum++;
+	d->pageData = (float*)TSF_MALLOC((residentNum ? residentNum : 1) * TSF_DISK_PAGESIZE * sizeof(float));
+	if (!d->pageData) return 0;
+	for (page = d->pageData, i = 0; i != d->pageNum; i++)
+	{
+		if (!d->pages[i]) continue;
+		tsf_disk_read(d, page, i << TSF_DISK_PAGEBITS, TSF_DISK_PAGESIZE);
+		d->pages[i] = page;
+		page += TSF_DISK_PAGESIZE;
 	}
+
+	// Ring buffers hold buffer_ms of the highest sample rate, rounded up to a power of two
+	ringMin = (unsigned int)(buffer_ms * (double)maxSampleRate / 1000.0);
+	while (ringSize < ringMin) ringSize <<= 1;
+	d->ringMask = ringSize - 1;
+	d->slotNum = (max_streams > 0 ? max_streams : 0);
+	d->slots = (struct tsf_disk_slot*)TSF_MALLOC((d->slotNum ? d->slotNum : 1) * sizeof(struct tsf_disk_slot));
+	d->ringData = (float*)TSF_MALLOC((d->slotNum ? d->slotNum : 1) * ringSize * sizeof(float));
+	if (!d->slots || !d->ringData) return 0;
+	TSF_MEMSET(d->slots, 0, (d->slotNum ? d->slotNum : 1) * sizeof(struct tsf_disk_slot));
+	for (i = 0; i != (unsigned int)d->slotNum; i++) d->slots[i].ring = d->ringData + i * ringSize;
 	return 1;
 }
+#endif
 
 #ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
 static int tsf_decode_ogg(const tsf_u8 *pSmpl, const tsf_u8 *pSmplEnd, float** pRes, tsf_u32* pResNum, tsf_u32* pResMax, tsf_u32 resInitial)
@@ -1060,6 +1857,7 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, short a
 					// I don't truly understand this; just following what LinuxSampler does.
 					float mysterySlope = -9.226f / e->samplesUntilNextSegment;
 					e->slope = TSF_EXPF(mysterySlope);
+					e->blockSlope = TSF_POWF(e->slope, (float)TSF_RENDER_EFFECTSAMPLEBLOCK);
 					e->segmentIsExponential = TSF_TRUE;
 					if (e->parameters.sustain > 0.0f)
 					{
@@ -1095,6 +1893,7 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, short a
 				// I don't truly understand this; just following what LinuxSampler does.
 				float mysterySlope = -9.226f / e->samplesUntilNextSegment;
 				e->slope = TSF_EXPF(mysterySlope);
+				e->blockSlope = TSF_POWF(e->slope, (float)TSF_RENDER_EFFECTSAMPLEBLOCK);
 				e->segmentIsExponential = TSF_TRUE;
 			}
 			else
@@ -1134,22 +1933,23 @@ static void tsf_voice_envelope_process(struct tsf_voice_envelope* e, int numSamp
 {
 	if (e->slope)
 	{
-		if (e->segmentIsExponential) e->level *= TSF_POWF(e->slope, (float)numSamples);
+		if (e->segmentIsExponential) e->level *= (numSamples == TSF_RENDER_EFFECTSAMPLEBLOCK ? e->blockSlope : TSF_POWF(e->slope, (float)numSamples));
 		else e->level += (e->slope * numSamples);
 	}
 	if ((e->samplesUntilNextSegment -= numSamples) <= 0)
 		tsf_voice_envelope_nextsegment(e, e->segment, outSampleRate);
 }
 
-static void tsf_voice_lowpass_setup(struct tsf_voice_lowpass* e, float Fc)
+// K is tan(pi * Fc) of the cutoff frequency Fc relative to the output sample rate
+static void tsf_voice_lowpass_setup(struct tsf_voice_controls* c, int k, double QInv, double K)
 {
 	// Lowpass filter from http://www.earlevel.com/main/2012/11/26/biquad-c-source-code/
-	double K = TSF_TAN(TSF_PI * Fc), KK = K * K;
-	double norm = 1 / (1 + K * e->QInv + KK);
-	e->a0 = KK * norm;
-	e->a1 = 2 * e->a0;
-	e->b1 = 2 * (KK - 1) * norm;
-	e->b2 = (1 - K * e->QInv + KK) * norm;
+	double KK = K * K;
+	double norm = 1 / (1 + K * QInv + KK);
+	c->lowpassA0[k] = KK * norm;
+	c->lowpassA1[k] = 2 * c->lowpassA0[k];
+	c->lowpassB1[k] = 2 * (KK - 1) * norm;
+	c->lowpassB2[k] = (1 - K * QInv + KK) * norm;
 }
 
 static float tsf_voice_lowpass_process(struct tsf_voice_lowpass* e, double In)
@@ -1157,208 +1957,633 @@ static float tsf_voice_lowpass_process(struct tsf_voice_lowpass* e, double In)
 	double Out = In * e->a0 + e->z1; e->z1 = In * e->a1 + e->z2 - e->b1 * Out; e->z2 = In * e->a0 - e->b2 * Out; return (float)Out;
 }
 
-static void tsf_voice_lfo_setup(struct tsf_voice_lfo* e, float delay, int freqCents, float outSampleRate)
+static void tsf_voice_lfo_setup(float* level, float* delta, int* samplesUntil, float delay, int freqCents, float outSampleRate)
 {
-	e->samplesUntil = (int)(delay * outSampleRate);
-	e->delta = (4.0f * tsf_cents2Hertz((float)freqCents) / outSampleRate);
-	e->level = 0;
+	*samplesUntil = (int)(delay * outSampleRate);
+	*delta = (4.0f * tsf_cents2Hertz((float)freqCents) / outSampleRate);
+	*level = 0;
 }
 
-static void tsf_voice_lfo_process(struct tsf_voice_lfo* e, int blockSamples)
+static void tsf_voice_lfo_process(float* level, float* delta, int* samplesUntil, int blockSamples)
 {
-	if (e->samplesUntil > blockSamples) { e->samplesUntil -= blockSamples; return; }
-	e->level += e->delta * blockSamples;
-	if      (e->level >  1.0f) { e->delta = -e->delta; e->level =  2.0f - e->level; }
-	else if (e->level < -1.0f) { e->delta = -e->delta; e->level = -2.0f - e->level; }
+	if (*samplesUntil > blockSamples) { *samplesUntil -= blockSamples; return; }
+	*level += *delta * blockSamples;
+	if      (*level >  1.0f) { *delta = -*delta; *level =  2.0f - *level; }
+	else if (*level < -1.0f) { *delta = -*delta; *level = -2.0f - *level; }
 }
 
-static void tsf_voice_kill(struct tsf_voice* v)
+static int tsf_voice_controls_grow(struct tsf_voice_controls* c, int voiceNum)
 {
-	v->playingPreset = -1;
+	#define TSF_CONTROLS_GROW(type, field) { type* p = (type*)TSF_REALLOC(c->field, voiceNum * sizeof(type)); if (!p) return 0; c->field = p; }
+	TSF_CONTROLS_GROW(unsigned char, flags) TSF_CONTROLS_GROW(unsigned char, lowpassActive)
+	TSF_CONTROLS_GROW(float, gainLeft) TSF_CONTROLS_GROW(float, gainRight) TSF_CONTROLS_GROW(float, noteGain)
+	TSF_CONTROLS_GROW(double, pitchRatio) TSF_CONTROLS_GROW(double, lowpassA0) TSF_CONTROLS_GROW(double, lowpassA1)
+	TSF_CONTROLS_GROW(double, lowpassB1) TSF_CONTROLS_GROW(double, lowpassB2)
+	TSF_CONTROLS_GROW(float, modLfoLevel) TSF_CONTROLS_GROW(float, modLfoDelta) TSF_CONTROLS_GROW(int, modLfoUntil)
+	TSF_CONTROLS_GROW(float, vibLfoLevel) TSF_CONTROLS_GROW(float, vibLfoDelta) TSF_CONTROLS_GROW(int, vibLfoUntil)
+	TSF_CONTROLS_GROW(float, initialFilterFc) TSF_CONTROLS_GROW(float, modLfoToFilterFc) TSF_CONTROLS_GROW(float, modEnvToFilterFc)
+	TSF_CONTROLS_GROW(float, modLfoToPitch) TSF_CONTROLS_GROW(float, vibLfoToPitch) TSF_CONTROLS_GROW(float, modEnvToPitch)
+	TSF_CONTROLS_GROW(float, modLfoToVolume)
+	#undef TSF_CONTROLS_GROW
+	return 1;
 }
 
-static void tsf_voice_end(tsf* f, struct tsf_voice* v)
+static void tsf_voice_controls_free(struct tsf_voice_controls* c)
 {
-	// if maxVoiceNum is set, assume that voice rendering and note queuing are on separate threads
-	// so to minimize the chance that voice rendering would advance the segment at the same time
-	// we just do it twice here and hope that it sticks
-	int repeats = (f->maxVoiceNum ? 2 : 1);
-	while (repeats--)
+	TSF_FREE(c->flags); TSF_FREE(c->lowpassActive);
+	TSF_FREE(c->gainLeft); TSF_FREE(c->gainRight); TSF_FREE(c->noteGain);
+	TSF_FREE(c->pitchRatio); TSF_FREE(c->lowpassA0); TSF_FREE(c->lowpassA1);
+	TSF_FREE(c->lowpassB1); TSF_FREE(c->lowpassB2);
+	TSF_FREE(c->modLfoLevel); TSF_FREE(c->modLfoDelta); TSF_FREE(c->modLfoUntil);
+	TSF_FREE(c->vibLfoLevel); TSF_FREE(c->vibLfoDelta); TSF_FREE(c->vibLfoUntil);
+	TSF_FREE(c->initialFilterFc); TSF_FREE(c->modLfoToFilterFc); TSF_FREE(c->modEnvToFilterFc);
+	TSF_FREE(c->modLfoToPitch); TSF_FREE(c->vibLfoToPitch); TSF_FREE(c->modEnvToPitch);
+	TSF_FREE(c->modLfoToVolume);
+}
+
+// Everything the sample loop of a voice needs for one block, the kernels run on a copy in locals
+struct tsf_voice_kernel_state
+{
+	double position, pitchRatio, sampleEnd, loopEnd; // loopEnd is one past the last looped sample
+	unsigned int loopStart, loopLast;
+	int tapFirst, tapLast; // range of samples the cubic and sinc taps may read
+	float gainLeft, gainRight; // gainLeft is the only gain with TSF_MONO
+	struct tsf_voice_lowpass lowpass;
+	const float* input;
+	const short* input16;
+	const float* sincTable;
+	struct tsf_disk* disk;
+	struct tsf_disk_slot* diskSlot;
+	int diskFilled;
+	int diskMissed; // set when a sample wasn't read in time
+};
+
+// The sinc table has a row of TSF_SINC_TAPS coefficients for each of the TSF_SINC_PHASES + 1 fractional
+// positions, the taps of a sample position start TSF_SINC_TAPS / 2 - 1 samples before it.
+#define TSF_SINC_TAPS 8
+#define TSF_SINC_PHASES 256
+
+static float* tsf_sinc_table_create(void)
+{
+	// Blackman windowed sinc, cut off a bit below Nyquist so the window's transition band doesn't
+	// fold back, and every row normalized to a DC gain of 1
+	const double cutoff = 0.9;
+	float* table = (float*)TSF_MALLOC((TSF_SINC_PHASES + 1) * TSF_SINC_TAPS * sizeof(float));
+	int phase, t;
+	if (!table) return TSF_NULL;
+	for (phase = 0; phase <= TSF_SINC_PHASES; phase++)
 	{
-		tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
-		tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
-		if (v->region->loop_mode == TSF_LOOPMODE_SUSTAIN)
+		float* row = table + phase * TSF_SINC_TAPS;
+		double sum = 0;
+		for (t = 0; t != TSF_SINC_TAPS; t++)
 		{
-			// Continue playing, but stop looping.
-			v->loopEnd = v->loopStart;
+			double x = t - (TSF_SINC_TAPS / 2 - 1) - (double)phase / TSF_SINC_PHASES;
+			double w = 0.42 + 0.5 * TSF_COS(TSF_PI * x / (TSF_SINC_TAPS / 2)) + 0.08 * TSF_COS(2 * TSF_PI * x / (TSF_SINC_TAPS / 2));
+			double sinc = (x == 0 ? 1.0 : TSF_SIN(TSF_PI * cutoff * x) / (TSF_PI * cutoff * x));
+			row[t] = (float)(w * sinc);
+			sum += row[t];
 		}
+		for (t = 0; t != TSF_SINC_TAPS; t++) row[t] = (float)(row[t] / sum);
 	}
+	return table;
 }
 
-static void tsf_voice_endquick(tsf* f, struct tsf_voice* v)
+static float tsf_sinc_dot(const float* taps, const float* coeffs)
 {
-	// if maxVoiceNum is set, assume that voice rendering and note queuing are on separate threads
-	// so to minimize the chance that voice rendering would advance the segment at the same time
-	// we just do it twice here and hope that it sticks
-	int repeats = (f->maxVoiceNum ? 2 : 1);
-	while (repeats--)
+	#if defined(TSF_SSE)
+	__m128 sum = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(taps), _mm_loadu_ps(coeffs)), _mm_mul_ps(_mm_loadu_ps(taps + 4), _mm_loadu_ps(coeffs + 4)));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+	#elif defined(TSF_NEON)
+	return vaddvq_f32(vmlaq_f32(vmulq_f32(vld1q_f32(taps), vld1q_f32(coeffs)), vld1q_f32(taps + 4), vld1q_f32(coeffs + 4)));
+	#else
+	return (taps[0] * coeffs[0] + taps[1] * coeffs[1] + taps[2] * coeffs[2] + taps[3] * coeffs[3])
+		+ (taps[4] * coeffs[4] + taps[5] * coeffs[5] + taps[6] * coeffs[6] + taps[7] * coeffs[7]);
+	#endif
+}
+
+// The sample loops are generated for every combination of interpolation, sample source, looping,
+// output mode and lowpass filter so that none of them has to check the voice configuration per sample.
+#define TSF_KERNEL_LINEAR_FLOAT(pos, nextPos, alpha) (input[pos] * (1.0f - alpha) + input[nextPos] * alpha)
+#define TSF_KERNEL_LINEAR_SHORT(pos, nextPos, alpha) ((input16[pos] * (1.0f - alpha) + input16[nextPos] * alpha) * (1.0f / 32767.0f))
+#define TSF_KERNEL_LINEAR_DISK(pos, nextPos, alpha) (tsf_disk_sample(s->disk, s->diskSlot, s->diskFilled, pos, &s->diskMissed) * (1.0f - alpha) + tsf_disk_sample(s->disk, s->diskSlot, s->diskFilled, nextPos, &s->diskMissed) * alpha)
+#define TSF_KERNEL_SAMPLE_FLOAT(i) input[i]
+#define TSF_KERNEL_SAMPLE_SHORT(i) (input16[i] * (1.0f / 32767.0f))
+#define TSF_KERNEL_SAMPLE_DISK(i) tsf_disk_sample(s->disk, s->diskSlot, s->diskFilled, i, &s->diskMissed)
+#define TSF_KERNEL_TAP(LOOPING, i) ((i) < tapFirst ? tapFirst : (LOOPING && (i) > (int)loopLast ? ((i) - loopSize > tapLast ? tapLast : (i) - loopSize) : ((i) > tapLast ? tapLast : (i))))
+#define TSF_KERNEL_INTERPOLATE_LINEAR(SAMPLE, LINEAR, LOOPING) val = LINEAR(pos, nextPos, alpha);
+#define TSF_KERNEL_INTERPOLATE_CUBIC(SAMPLE, LINEAR, LOOPING) \
+	{ \
+		float xm1 = SAMPLE(TSF_KERNEL_TAP(LOOPING, (int)pos - 1)), x0 = SAMPLE(pos), x1 = SAMPLE(nextPos), x2 = SAMPLE(TSF_KERNEL_TAP(LOOPING, (int)pos + 2)); \
+		val = x0 + 0.5f * alpha * (x1 - xm1 + alpha * (2.0f * xm1 - 5.0f * x0 + 4.0f * x1 - x2 + alpha * (3.0f * (x0 - x1) + x2 - xm1))); \
+	}
+#define TSF_KERNEL_INTERPOLATE_SINC(SAMPLE, LINEAR, LOOPING) \
+	{ \
+		float taps[TSF_SINC_TAPS]; int t; (void)nextPos; \
+		for (t = 0; t != TSF_SINC_TAPS; t++) taps[t] = SAMPLE(TSF_KERNEL_TAP(LOOPING, (int)pos + t - (TSF_SINC_TAPS / 2 - 1))); \
+		val = tsf_sinc_dot(taps, sincTable + (int)(alpha * TSF_SINC_PHASES + 0.5f) * TSF_SINC_TAPS); \
+	}
+#define TSF_KERNEL_OUTPUT_INTERLEAVED *outL++ += val * gainLeft; *outL++ += val * gainRight;
+#define TSF_KERNEL_OUTPUT_UNWEAVED    *outL++ += val * gainLeft; *outR++ += val * gainRight;
+#define TSF_KERNEL_OUTPUT_MONO        *outL++ += val * gainLeft;
+#define TSF_KERNEL(name, INTERPOLATE, SAMPLE, LINEAR, LOOPING, FILTERED, OUTPUT) \
+	static void name(struct tsf_voice_kernel_state* s, float* outL, float* outR, int blockSamples) \
+	{ \
+		double position = s->position, pitchRatio = s->pitchRatio, sampleEnd = s->sampleEnd, loopEnd = s->loopEnd; \
+		double loopLength = s->loopEnd - s->loopStart; \
+		unsigned int loopStart = s->loopStart, loopLast = s->loopLast; \
+		int tapFirst = s->tapFirst, tapLast = s->tapLast, loopSize = (int)(loopLast + 1 - loopStart); \
+		float gainLeft = s->gainLeft, gainRight = s->gainRight; \
+		const float* input = s->input; const short* input16 = s->input16; const float* sincTable = s->sincTable; \
+		struct tsf_voice_lowpass lowpass = s->lowpass; \
+		(void)outR; (void)gainRight; (void)input; (void)input16; (void)sincTable; (void)tapFirst; (void)tapLast; (void)loopSize; \
+		(void)loopStart; (void)loopLast; (void)loopEnd; (void)loopLength; \
+		while (blockSamples-- && position < sampleEnd) \
+		{ \
+			unsigned int pos = (unsigned int)position, nextPos = (LOOPING && pos >= loopLast ? loopStart : pos + 1); \
+			float alpha = (float)(position - pos), val; \
+			INTERPOLATE(SAMPLE, LINEAR, LOOPING) \
+			/* Low-pass filter. */ \
+			if (FILTERED) val = tsf_voice_lowpass_process(&lowpass, val); \
+			OUTPUT \
+			/* Next sample. */ \
+			position += pitchRatio; \
+			if (LOOPING && position >= loopEnd) position -= loopLength; \
+		} \
+		s->position = position; \
+		s->lowpass.z1 = lowpass.z1, s->lowpass.z2 = lowpass.z2; \
+	}
+#define TSF_KERNELS_OUTPUT(name, INTERPOLATE, SAMPLE, LINEAR, LOOPING, OUTPUT) \
+	TSF_KERNEL(name##_dry, INTERPOLATE, SAMPLE, LINEAR, LOOPING, 0, OUTPUT) \
+	TSF_KERNEL(name##_lowpass, INTERPOLATE, SAMPLE, LINEAR, LOOPING, 1, OUTPUT)
+#define TSF_KERNELS_LOOPING(name, INTERPOLATE, SAMPLE, LINEAR, LOOPING) \
+	TSF_KERNELS_OUTPUT(name##_interleaved, INTERPOLATE, SAMPLE, LINEAR, LOOPING, TSF_KERNEL_OUTPUT_INTERLEAVED) \
+	TSF_KERNELS_OUTPUT(name##_unweaved, INTERPOLATE, SAMPLE, LINEAR, LOOPING, TSF_KERNEL_OUTPUT_UNWEAVED) \
+	TSF_KERNELS_OUTPUT(name##_mono, INTERPOLATE, SAMPLE, LINEAR, LOOPING, TSF_KERNEL_OUTPUT_MONO)
+#define TSF_KERNELS_SOURCE(name, INTERPOLATE, SAMPLE, LINEAR) \
+	TSF_KERNELS_LOOPING(name##_once, INTERPOLATE, SAMPLE, LINEAR, 0) \
+	TSF_KERNELS_LOOPING(name##_loop, INTERPOLATE, SAMPLE, LINEAR, 1)
+#define TSF_KERNELS_INTERPOLATION(name, INTERPOLATE) \
+	TSF_KERNELS_SOURCE(name##_float, INTERPOLATE, TSF_KERNEL_SAMPLE_FLOAT, TSF_KERNEL_LINEAR_FLOAT) \
+	TSF_KERNELS_SOURCE(name##_short, INTERPOLATE, TSF_KERNEL_SAMPLE_SHORT, TSF_KERNEL_LINEAR_SHORT) \
+	TSF_KERNELS_SOURCE(name##_disk, INTERPOLATE, TSF_KERNEL_SAMPLE_DISK, TSF_KERNEL_LINEAR_DISK)
+TSF_KERNELS_INTERPOLATION(tsf_kernel_linear, TSF_KERNEL_INTERPOLATE_LINEAR)
+TSF_KERNELS_INTERPOLATION(tsf_kernel_cubic, TSF_KERNEL_INTERPOLATE_CUBIC)
+TSF_KERNELS_INTERPOLATION(tsf_kernel_sinc, TSF_KERNEL_INTERPOLATE_SINC)
+
+// Indexed [interpolation][source][looping][outputmode][lowpass active], the source is 0 for converted
+// floats, 1 for 16-bit samples referenced in place and 2 for streamed samples
+#define TSF_KERNELS_ROW(name) { { name##_interleaved_dry, name##_interleaved_lowpass }, { name##_unweaved_dry, name##_unweaved_lowpass }, { name##_mono_dry, name##_mono_lowpass } }
+#define TSF_KERNELS_SOURCE_TABLE(name) { TSF_KERNELS_ROW(name##_once), TSF_KERNELS_ROW(name##_loop) }
+#define TSF_KERNELS_TABLE(name) { TSF_KERNELS_SOURCE_TABLE(name##_float), TSF_KERNELS_SOURCE_TABLE(name##_short), TSF_KERNELS_SOURCE_TABLE(name##_disk) }
+static const tsf_voice_kernel tsf_voice_kernels[3][3][2][3][2] = { TSF_KERNELS_TABLE(tsf_kernel_linear), TSF_KERNELS_TABLE(tsf_kernel_cubic), TSF_KERNELS_TABLE(tsf_kernel_sinc) };
+#undef TSF_KERNELS_TABLE
+#undef TSF_KERNELS_SOURCE_TABLE
+#undef TSF_KERNELS_ROW
+#undef TSF_KERNELS_INTERPOLATION
+#undef TSF_KERNELS_SOURCE
+#undef TSF_KERNELS_LOOPING
+#undef TSF_KERNELS_OUTPUT
+#undef TSF_KERNEL
+#undef TSF_KERNEL_OUTPUT_MONO
+#undef TSF_KERNEL_OUTPUT_UNWEAVED
+#undef TSF_KERNEL_OUTPUT_INTERLEAVED
+#undef TSF_KERNEL_INTERPOLATE_SINC
+#undef TSF_KERNEL_INTERPOLATE_CUBIC
+#undef TSF_KERNEL_INTERPOLATE_LINEAR
+#undef TSF_KERNEL_TAP
+#undef TSF_KERNEL_SAMPLE_DISK
+#undef TSF_KERNEL_SAMPLE_SHORT
+#undef TSF_KERNEL_SAMPLE_FLOAT
+#undef TSF_KERNEL_LINEAR_DISK
+#undef TSF_KERNEL_LINEAR_SHORT
+#undef TSF_KERNEL_LINEAR_FLOAT
+
+static void tsf_voice_select_kernels(tsf* f, struct tsf_voice* v)
+{
+	int source = (f->fontSamples || v->mipLevel ? 0 : (f->fontSamples16 ? 1 : 2)), interpolation = f->interpolation;
+	if (interpolation == TSF_INTERPOLATION_AUTO)
 	{
-		v->ampenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
-		v->modenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+		// Only a few voices of the focused channels get the expensive interpolation
+		TSF_BOOL focus = (f->channels && v->playingChannel >= 0 && f->channels->channels[v->playingChannel].focus);
+		if (focus && !v->focused && f->focusVoiceNum < TSF_FOCUSVOICES) { v->focused = 1; f->focusVoiceNum++; }
+		interpolation = (v->focused ? TSF_INTERPOLATION_SINC : TSF_INTERPOLATION_LINEAR);
 	}
+	v->kernels = tsf_voice_kernels[interpolation][source][v->loopStart < v->loopEnd];
 }
 
-static void tsf_voice_calcpitchratio(struct tsf_voice* v, float pitchShift, float outSampleRate)
+static struct tsf_voice* tsf_voice_alloc(tsf* f)
 {
-	double note = v->playingKey + v->region->transpose + v->region->tune / 100.0;
-	double adjustedPitch = v->region->pitch_keycenter + (note - v->region->pitch_keycenter) * (v->region->pitch_keytrack / 100.0);
-	if (pitchShift) adjustedPitch += pitchShift;
-	v->pitchInputTimecents = adjustedPitch * 100.0;
-	v->pitchOutputFactor = v->region->sample_rate / (tsf_timecents2Secsd(v->region->pitch_keycenter * 100.0) * outSampleRate);
+	struct tsf_voice* v;
+	if (!f->freeVoice) return TSF_NULL;
+	v = &f->voices[f->freeVoice - 1];
+	f->freeVoice = v->nextFree;
+	v->activeIndex = f->activeVoiceNum;
+	f->activeVoices[f->activeVoiceNum++] = (int)(v - f->voices);
+	return v;
 }
 
-static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outputBuffer, int numSamples)
+static void tsf_voice_link(tsf* f, struct tsf_voice* v, int channel)
 {
-	struct tsf_region* region = v->region;
-	float* input = f->fontSamples;
-	float* outL = outputBuffer;
-	float* outR = (f->outputmode == TSF_STEREO_UNWEAVED ? outL + numSamples : TSF_NULL);
+	int index = (int)(v - f->voices) + 1, *head;
+	v->keyList = (channel + 1) * 128 + v->playingKey;
+	head = &f->keyVoices[v->keyList];
+	v->keyPrev = 0;
+	v->keyNext = *head;
+	if (*head) f->voices[*head - 1].keyPrev = index;
+	*head = index;
+	if (v->region->group)
+	{
+		head = &f->groupVoices[v->region->group & (TSF_GROUPLISTS - 1)];
+		v->groupPrev = 0;
+		v->groupNext = *head;
+		if (*head) f->voices[*head - 1].groupPrev = index;
+		*head = index;
+	}
+}
 
-	// Cache some values, to give them at least some chance of ending up in registers.
-	TSF_BOOL updateModEnv = (region->modEnvToPitch || region->modEnvToFilterFc);
-	TSF_BOOL updateModLFO = (v->modlfo.delta && (region->modLfoToPitch || region->modLfoToFilterFc || region->modLfoToVolume));
-	TSF_BOOL updateVibLFO = (v->viblfo.delta && (region->vibLfoToPitch));
-	TSF_BOOL isLooping    = (v->loopStart < v->loopEnd);
-	unsigned int tmpLoopStart = v->loopStart, tmpLoopEnd = v->loopEnd;
-	double tmpSampleEndDbl = (double)region->end, tmpLoopEndDbl = (double)tmpLoopEnd + 1.0;
-	double tmpSourceSamplePosition = v->sourceSamplePosition;
-	struct tsf_voice_lowpass tmpLowpass = v->lowpass;
+static void tsf_voice_unlink(tsf* f, struct tsf_voice* v)
+{
+	if (v->keyPrev) f->voices[v->keyPrev - 1].keyNext = v->keyNext;
+	else f->keyVoices[v->keyList] = v->keyNext;
+	if (v->keyNext) f->voices[v->keyNext - 1].keyPrev = v->keyPrev;
+	if (v->region->group)
+	{
+		if (v->groupPrev) f->voices[v->groupPrev - 1].groupNext = v->groupNext;
+		else f->groupVoices[v->region->group & (TSF_GROUPLISTS - 1)] = v->groupNext;
+		if (v->groupNext) f->voices[v->groupNext - 1].groupPrev = v->groupPrev;
+	}
+}
 
-	TSF_BOOL dynamicLowpass = (region->modLfoToFilterFc || region->modEnvToFilterFc);
-	float tmpSampleRate = f->outSampleRate, tmpInitialFilterFc, tmpModLfoToFilterFc, tmpModEnvToFilterFc;
+static int tsf_voice_keylists_grow(tsf* f, int channelNum)
+{
+	// One set of key lists per channel plus one for voices started without a channel
+	int *newKeyVoices, oldSize = (f->keyVoices ? (f->keyVoiceChannelNum + 1) * 128 : 0), newSize = (channelNum + 1) * 128;
+	if (newSize <= oldSize) return 1;
+	newKeyVoices = (int*)TSF_REALLOC(f->keyVoices, newSize * sizeof(int));
+	if (!newKeyVoices) return 0;
+	TSF_MEMSET(newKeyVoices + oldSize, 0, (newSize - oldSize) * sizeof(int));
+	f->keyVoices = newKeyVoices;
+	f->keyVoiceChannelNum = channelNum;
+	return 1;
+}
 
-	TSF_BOOL dynamicPitchRatio = (region->modLfoToPitch || region->modEnvToPitch || region->vibLfoToPitch);
-	double pitchRatio;
-	float tmpModLfoToPitch, tmpVibLfoToPitch, tmpModEnvToPitch;
+static TSF_BOOL tsf_voice_steal_before(const tsf* f, const struct tsf_voice* a, const struct tsf_voice* b)
+{
+	TSF_BOOL aReleased = (a->ampenv.segment >= TSF_SEGMENT_RELEASE), bReleased = (b->ampenv.segment >= TSF_SEGMENT_RELEASE);
+	if (aReleased != bReleased) return aReleased;
+	if (f->stealPolicy == TSF_STEAL_QUIETEST && a->noteGainDB != b->noteGainDB) return (a->noteGainDB < b->noteGainDB);
+	if (f->stealPolicy == TSF_STEAL_CHANNEL_PRIORITY && f->channels)
+	{
+		int aPriority = (a->playingChannel >= 0 && a->playingChannel < f->channels->channelNum ? f->channels->channels[a->playingChannel].stealPriority : 0);
+		int bPriority = (b->playingChannel >= 0 && b->playingChannel < f->channels->channelNum ? f->channels->channels[b->playingChannel].stealPriority : 0);
+		if (aPriority != bPriority) return (aPriority < bPriority);
+	}
+	return ((int)(a->stealIndex - b->stealIndex) < 0);
+}
 
-	TSF_BOOL dynamicGain = (region->modLfoToVolume != 0);
-	float noteGain = 0, tmpModLfoToVolume;
+static void tsf_voice_heap_place(tsf* f, int pos, int voiceIndex)
+{
+	f->stealHeap[pos] = voiceIndex;
+	f->voices[voiceIndex].heapIndex = pos;
+}
 
-	if (dynamicLowpass) tmpInitialFilterFc = (float)region->initialFilterFc, tmpModLfoToFilterFc = (float)region->modLfoToFilterFc, tmpModEnvToFilterFc = (float)region->modEnvToFilterFc;
-	else tmpInitialFilterFc = 0, tmpModLfoToFilterFc = 0, tmpModEnvToFilterFc = 0;
+static void tsf_voice_heap_sift(tsf* f, int pos, TSF_BOOL up)
+{
+	int voiceIndex = f->stealHeap[pos], child;
+	const struct tsf_voice* v = &f->voices[voiceIndex];
+	while (up && pos && tsf_voice_steal_before(f, v, &f->voices[f->stealHeap[(pos - 1) >> 1]]))
+	{
+		tsf_voice_heap_place(f, pos, f->stealHeap[(pos - 1) >> 1]);
+		pos = (pos - 1) >> 1;
+	}
+	while ((child = pos * 2 + 1) < f->stealHeapNum)
+	{
+		if (child + 1 < f->stealHeapNum && tsf_voice_steal_before(f, &f->voices[f->stealHeap[child + 1]], &f->voices[f->stealHeap[child]])) child++;
+		if (!tsf_voice_steal_before(f, &f->voices[f->stealHeap[child]], v)) break;
+		tsf_voice_heap_place(f, pos, f->stealHeap[child]);
+		pos = child;
+	}
+	tsf_voice_heap_place(f, pos, voiceIndex);
+}
 
-	if (dynamicPitchRatio) pitchRatio = 0, tmpModLfoToPitch = (float)region->modLfoToPitch, tmpVibLfoToPitch = (float)region->vibLfoToPitch, tmpModEnvToPitch = (float)region->modEnvToPitch;
-	else pitchRatio = tsf_timecents2Secsd(v->pitchInputTimecents) * v->pitchOutputFactor, tmpModLfoToPitch = 0, tmpVibLfoToPitch = 0, tmpModEnvToPitch = 0;
+static void tsf_voice_heap_push(tsf* f, struct tsf_voice* v)
+{
+	v->stealIndex = f->voiceStealIndex++;
+	tsf_voice_heap_place(f, f->stealHeapNum++, (int)(v - f->voices));
+	tsf_voice_heap_sift(f, v->heapIndex, TSF_TRUE);
+}
 
-	if (dynamicGain) tmpModLfoToVolume = (float)region->modLfoToVolume * 0.1f;
-	else noteGain = tsf_decibelsToGain(v->noteGainDB), tmpModLfoToVolume = 0;
+static void tsf_voice_heap_remove(tsf* f, struct tsf_voice* v)
+{
+	int pos = v->heapIndex, last = f->stealHeap[--f->stealHeapNum];
+	if (pos == f->stealHeapNum) return;
+	tsf_voice_heap_place(f, pos, last);
+	tsf_voice_heap_sift(f, pos, TSF_TRUE);
+}
 
-	while (numSamples)
-	{
-		float gainMono, gainLeft, gainRight;
-		int blockSamples = (numSamples > TSF_RENDER_EFFECTSAMPLEBLOCK ? TSF_RENDER_EFFECTSAMPLEBLOCK : numSamples);
-		numSamples -= blockSamples;
+static void tsf_voice_heap_rebuild(tsf* f)
+{
+	// Needed after something changed the order of many voices at once
+	int i;
+	for (i = f->stealHeapNum / 2; i--;) tsf_voice_heap_sift(f, i, TSF_FALSE);
+}
+
+static void tsf_voice_released(tsf* f, struct tsf_voice* v, TSF_BOOL wasReleased)
+{
+	if (wasReleased || v->ampenv.segment < TSF_SEGMENT_RELEASE) return;
+	v->stealIndex = f->voiceStealIndex++;
+	tsf_voice_heap_sift(f, v->heapIndex, TSF_TRUE);
+}
+
+static struct tsf_voice* tsf_voice_heap_best(tsf* f, int pos, unsigned int playIndex)
+{
+	// Voices below one that may be stolen come later, so only the voices of the note being started
+	// (regions layered on the same key) are looked past. Their number bounds the recursion.
+	struct tsf_voice *v, *a, *b;
+	if (pos >= f->stealHeapNum) return TSF_NULL;
+	v = &f->voices[f->stealHeap[pos]];
+	if (v->playIndex != playIndex) return v;
+	a = tsf_voice_heap_best(f, pos * 2 + 1, playIndex);
+	b = tsf_voice_heap_best(f, pos * 2 + 2, playIndex);
+	return (!a || (b && tsf_voice_steal_before(f, b, a)) ? b : a);
+}
 
-		if (dynamicLowpass)
+static struct tsf_voice* tsf_voice_steal(tsf* f, int key, unsigned int playIndex)
+{
+	struct tsf_voice *v, *best = TSF_NULL;
+	int i;
+	if (!f->stealHeapNum) return TSF_NULL;
+	if (f->stealPolicy == TSF_STEAL_SAME_NOTE)
+	{
+		// Voices of the same channel and key that don't belong to the note being started
+		for (i = f->keyVoices[((f->channels ? f->channels->activeChannel : -1) + 1) * 128 + key]; i; i = v->keyNext)
 		{
-			float fres = tmpInitialFilterFc + v->modlfo.level * tmpModLfoToFilterFc + v->modenv.level * tmpModEnvToFilterFc;
-			float lowpassFc = (fres <= 13500 ? tsf_cents2Hertz(fres) / tmpSampleRate : 1.0f);
-			tmpLowpass.active = (lowpassFc < 0.499f);
-			if (tmpLowpass.active) tsf_voice_lowpass_setup(&tmpLowpass, lowpassFc);
+			v = &f->voices[i - 1];
+			if (v->playIndex != playIndex && (!best || tsf_voice_steal_before(f, v, best))) best = v;
 		}
+		if (best) return best;
+	}
+	// Never the other regions of the note being started, whatever the policy
+	return tsf_voice_heap_best(f, 0, playIndex);
+}
 
-		if (dynamicPitchRatio)
-			pitchRatio = tsf_timecents2Secsd(v->pitchInputTimecents + (v->modlfo.level * tmpModLfoToPitch + v->viblfo.level * tmpVibLfoToPitch + v->modenv.level * tmpModEnvToPitch)) * v->pitchOutputFactor;
-
-		if (dynamicGain)
-			noteGain = tsf_decibelsToGain(v->noteGainDB + (v->modlfo.level * tmpModLfoToVolume));
+static void tsf_voice_kill(tsf* f, struct tsf_voice* v)
+{
+	int last;
+	if (v->diskSlot)
+	{
+		TSF_ATOMIC_STORE(&v->diskSlot->state, TSF_DISK_RELEASED);
+		v->diskSlot = TSF_NULL;
+	}
+	tsf_voice_unlink(f, v);
+	tsf_voice_heap_remove(f, v);
+	v->playingPreset = -1;
+	if (v->focused) { v->focused = 0; f->focusVoiceNum--; }
 
-		gainMono = noteGain * v->ampenv.level;
+	// Move the last active voice into its place and put it on the free list
+	last = f->activeVoices[--f->activeVoiceNum];
+	f->activeVoices[v->activeIndex] = last;
+	f->voices[last].activeIndex = v->activeIndex;
+	v->nextFree = f->freeVoice;
+	f->freeVoice = (int)(v - f->voices) + 1;
+}
 
-		// Update EG.
-		tsf_voice_envelope_process(&v->ampenv, blockSamples, tmpSampleRate);
-		if (updateModEnv) tsf_voice_envelope_process(&v->modenv, blockSamples, tmpSampleRate);
+static int tsf_voice_grow(tsf* f, int voiceNum)
+{
+	int i;
+	struct tsf_voice* newVoices;
+	int *newActiveVoices, *newStealHeap;
+	if (!f->keyVoices && !tsf_voice_keylists_grow(f, (f->channels ? f->channels->channelNum : 0))) return 0;
+	newActiveVoices = (int*)TSF_REALLOC(f->activeVoices, voiceNum * sizeof(int));
+	if (!newActiveVoices) return 0;
+	f->activeVoices = newActiveVoices;
+	newStealHeap = (int*)TSF_REALLOC(f->stealHeap, voiceNum * sizeof(int));
+	if (!newStealHeap) return 0;
+	f->stealHeap = newStealHeap;
+	if (!tsf_voice_controls_grow(&f->controls, voiceNum)) return 0;
+	newVoices = (struct tsf_voice*)TSF_REALLOC(f->voices, voiceNum * sizeof(struct tsf_voice));
+	if (!newVoices) return 0;
+	f->voices = newVoices;
 
-		// Update LFOs.
-		if (updateModLFO) tsf_voice_lfo_process(&v->modlfo, blockSamples);
-		if (updateVibLFO) tsf_voice_lfo_process(&v->viblfo, blockSamples);
+	// Add the new voices to the free list, lowest index first
+	for (i = voiceNum; i-- > f->voiceNum;)
+	{
+		newVoices[i].playingPreset = -1;
+		newVoices[i].diskSlot = TSF_NULL;
+		newVoices[i].focused = 0;
+		newVoices[i].nextFree = f->freeVoice;
+		f->freeVoice = i + 1;
+	}
+	f->voiceNum = voiceNum;
+	return 1;
+}
 
-		switch (f->outputmode)
+static void tsf_voice_end(tsf* f, struct tsf_voice* v)
+{
+	// if maxVoiceNum is set, assume that voice rendering and note queuing are on separate threads
+	// so to minimize the chance that voice rendering would advance the segment at the same time
+	// we just do it twice here and hope that it sticks
+	int repeats = (f->maxVoiceNum ? 2 : 1);
+	TSF_BOOL wasReleased = (v->ampenv.segment >= TSF_SEGMENT_RELEASE);
+	while (repeats--)
+	{
+		tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+		tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+		if (v->region->loop_mode == TSF_LOOPMODE_SUSTAIN)
 		{
-			case TSF_STEREO_INTERLEAVED:
-				gainLeft = gainMono * v->panFactorLeft, gainRight = gainMono * v->panFactorRight;
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
-				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
-
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
-
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
+			// Continue playing, but stop looping.
+			v->loopEnd = v->loopStart;
+			tsf_voice_select_kernels(f, v);
+		}
+	}
+	tsf_voice_released(f, v, wasReleased);
+}
 
-					*outL++ += val * gainLeft;
-					*outL++ += val * gainRight;
+static void tsf_voice_endquick(tsf* f, struct tsf_voice* v)
+{
+	// if maxVoiceNum is set, assume that voice rendering and note queuing are on separate threads
+	// so to minimize the chance that voice rendering would advance the segment at the same time
+	// we just do it twice here and hope that it sticks
+	int repeats = (f->maxVoiceNum ? 2 : 1);
+	TSF_BOOL wasReleased = (v->ampenv.segment >= TSF_SEGMENT_RELEASE);
+	while (repeats--)
+	{
+		v->ampenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+		v->modenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+	}
+	tsf_voice_released(f, v, wasReleased);
+}
 
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
-				}
-				break;
+static void tsf_voice_calcpitchratio(struct tsf_voice* v, float pitchShift, float outSampleRate)
+{
+	double note = v->playingKey + v->region->transpose + v->region->tune / 100.0;
+	double adjustedPitch = v->region->pitch_keycenter + (note - v->region->pitch_keycenter) * (v->region->pitch_keytrack / 100.0);
+	if (pitchShift) adjustedPitch += pitchShift;
+	v->pitchInputTimecents = adjustedPitch * 100.0;
+	v->pitchOutputFactor = v->region->sample_rate / (tsf_timecents2Secsd(v->region->pitch_keycenter * 100.0) * outSampleRate);
+	if (v->mipLevel) v->pitchOutputFactor /= (double)(1 << v->mipLevel);
+}
+
+// Switches a voice that starts with a pitch ratio of 2 or more to the decimated samples that make
+// the ratio lower than 2. Looping voices need a loop length that stays whole in the decimated samples.
+static void tsf_voice_select_mip(tsf* f, struct tsf_voice* v)
+{
+	double pitchRatio = tsf_timecents2Secsd(v->pitchInputTimecents) * v->pitchOutputFactor;
+	TSF_BOOL isLooping = (v->loopStart < v->loopEnd);
+	unsigned int loopSize = v->loopEnd - v->loopStart + 1;
+	int level = 0;
+	while (level < f->mipLevels && pitchRatio >= (double)(2 << level) && (!isLooping || loopSize % (2u << level) == 0)) level++;
+	if (!level) return;
+	v->mipLevel = level;
+	v->pitchOutputFactor /= (double)(1 << level);
+	v->sourceSamplePosition /= (double)(1 << level);
+	if (isLooping)
+	{
+		v->loopStart >>= level;
+		v->loopEnd = v->loopStart + (loopSize >> level) - 1;
+	}
+}
 
-			case TSF_STEREO_UNWEAVED:
-				gainLeft = gainMono * v->panFactorLeft, gainRight = gainMono * v->panFactorRight;
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
-				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
+// Updates the controls of voice k for the next block and advances its envelopes. Values that
+// aren't modulated only change between render calls, so they're computed on the first block.
+static void tsf_voice_control(tsf* f, int k, int blockSamples, TSF_BOOL firstBlock)
+{
+	struct tsf_voice* v = &f->voices[k];
+	struct tsf_voice_controls* c = &f->controls;
+	int flags = c->flags[k];
+	TSF_BOOL wasReleased = (v->ampenv.segment >= TSF_SEGMENT_RELEASE);
+	float gainMono;
 
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
+	if (flags & TSF_CONTROL_LOWPASS)
+	{
+		float fres = c->initialFilterFc[k] + c->modLfoLevel[k] * c->modLfoToFilterFc[k] + v->modenv.level * c->modEnvToFilterFc[k];
+		float lowpassFc = (fres <= 13500 ? tsf_fastCents2Hertz(fres) / f->outSampleRate : 1.0f);
+		c->lowpassActive[k] = (lowpassFc < 0.499f);
+		if (c->lowpassActive[k]) tsf_voice_lowpass_setup(c, k, v->lowpassQInv, tsf_fastTan(TSF_PI * lowpassFc));
+	}
 
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
+	if (flags & TSF_CONTROL_PITCH)
+		c->pitchRatio[k] = tsf_fastExp2((v->pitchInputTimecents + (c->modLfoLevel[k] * c->modLfoToPitch[k] + c->vibLfoLevel[k] * c->vibLfoToPitch[k] + v->modenv.level * c->modEnvToPitch[k])) / 1200.0) * v->pitchOutputFactor;
+	else if (firstBlock)
+		c->pitchRatio[k] = tsf_timecents2Secsd(v->pitchInputTimecents) * v->pitchOutputFactor;
 
-					*outL++ += val * gainLeft;
-					*outR++ += val * gainRight;
+	if (flags & TSF_CONTROL_GAIN)
+		c->noteGain[k] = tsf_fastDecibelsToGain(v->noteGainDB + (c->modLfoLevel[k] * c->modLfoToVolume[k]));
+	else if (firstBlock)
+		c->noteGain[k] = tsf_decibelsToGain(v->noteGainDB);
 
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
-				}
-				break;
+	gainMono = c->noteGain[k] * v->ampenv.level;
+	if (f->outputmode == TSF_MONO) c->gainLeft[k] = gainMono;
+	else c->gainLeft[k] = gainMono * v->panFactorLeft, c->gainRight[k] = gainMono * v->panFactorRight;
 
-			case TSF_MONO:
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
-				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
+	// Update EG.
+	tsf_voice_envelope_process(&v->ampenv, blockSamples, f->outSampleRate);
+	if (flags & TSF_CONTROL_MODENV) tsf_voice_envelope_process(&v->modenv, blockSamples, f->outSampleRate);
 
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
+	// End the voice when it stays below the cull threshold from the start to the end of the block, the
+	// render of this block finishes it like a voice whose envelope ended
+	if (gainMono < f->cullGain && v->ampenv.segment >= TSF_SEGMENT_DECAY && v->ampenv.segment != TSF_SEGMENT_DONE
+		&& c->noteGain[k] * v->ampenv.level < f->cullGain)
+	{
+		tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_RELEASE, f->outSampleRate);
+		TSF_ATOMIC_INC(&f->culledVoices);
+	}
 
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
+	// The steal heap orders released voices first, it is only changed on the note on/off thread
+	if (!wasReleased && v->ampenv.segment >= TSF_SEGMENT_RELEASE) v->releasedInRender = 1;
+}
+
+// Renders one block of voice k with the controls of tsf_voice_control, outR is only used with TSF_STEREO_UNWEAVED.
+// Returns TSF_TRUE when the voice finished playing, the caller has to kill it
+static TSF_BOOL tsf_voice_render(tsf* f, int k, float* outL, float* outR, int blockSamples)
+{
+	struct tsf_voice* v = &f->voices[k];
+	struct tsf_voice_controls* c = &f->controls;
+	struct tsf_voice_kernel_state s;
+	const tsf_voice_kernel (*kernels)[2] = v->kernels;
+
+	s.position = v->sourceSamplePosition;
+	s.pitchRatio = c->pitchRatio[k];
+	s.sampleEnd = (double)v->region->end / (1 << v->mipLevel);
+	s.loopStart = v->loopStart, s.loopLast = v->loopEnd, s.loopEnd = (double)v->loopEnd + 1.0;
+	s.tapFirst = (int)(v->region->offset >> v->mipLevel);
+	s.tapLast = (int)((v->region->end < f->fontSampleCount ? v->region->end : f->fontSampleCount - 1) >> v->mipLevel);
+	s.gainLeft = c->gainLeft[k], s.gainRight = (f->outputmode == TSF_MONO ? 0 : c->gainRight[k]);
+	s.lowpass.active = c->lowpassActive[k];
+	s.lowpass.a0 = c->lowpassA0[k], s.lowpass.a1 = c->lowpassA1[k], s.lowpass.b1 = c->lowpassB1[k], s.lowpass.b2 = c->lowpassB2[k];
+	s.lowpass.z1 = v->lowpassZ1, s.lowpass.z2 = v->lowpassZ2;
+
+	// Samples are either converted floats, 16-bit integers referenced in place (memory mapped loading)
+	// or resident pages and ring buffers filled by the I/O thread (streaming loading)
+	s.input = (v->mipLevel ? f->mipSamples[v->mipLevel - 1] : f->fontSamples), s.input16 = f->fontSamples16, s.sincTable = f->sincTable;
+	s.disk = f->disk, s.diskSlot = v->diskSlot;
+	s.diskFilled = (v->diskSlot ? TSF_ATOMIC_LOAD(&v->diskSlot->filled) : 0);
+	s.diskMissed = 0;
+
+	kernels[f->outputmode][s.lowpass.active ? 1 : 0](&s, outL, outR, blockSamples);
+	if (s.diskMissed) TSF_ATOMIC_INC(&f->disk->underruns);
+
+	if (s.position >= s.sampleEnd || v->ampenv.segment == TSF_SEGMENT_DONE)
+		return TSF_TRUE;
+
+	v->sourceSamplePosition = s.position;
+	v->lowpassZ1 = s.lowpass.z1, v->lowpassZ2 = s.lowpass.z2;
+
+	// Let the I/O thread know how far it can fill the ring buffer, keeping the samples the cubic
+	// and sinc taps read behind the position
+	if (v->diskSlot && s.position >= v->diskSlot->start + TSF_SINC_TAPS / 2)
+		TSF_ATOMIC_STORE(&v->diskSlot->consumed, (int)((unsigned int)s.position - v->diskSlot->start) - TSF_SINC_TAPS / 2);
+	return TSF_FALSE;
+}
+
+// Renders the voices of a group block by block. Each block first updates the controls and then
+// the LFOs of all voices in passes over the control arrays, then runs the sample loop of each
+// voice. Voices still add up in active list order, so the output matches rendering voice by voice.
+static void tsf_render_voices(tsf* f, int group, int groupCount, float* buffer, float* buses, int busCount, int samples)
+{
+	struct tsf_voice_controls* c = &f->controls;
+	int busSize = (f->outputmode == TSF_MONO ? 1 : 2) * samples;
+	int blockStart, i, k;
+	for (blockStart = 0; blockStart < samples; blockStart += TSF_RENDER_EFFECTSAMPLEBLOCK)
+	{
+		int blockSamples = (samples - blockStart > TSF_RENDER_EFFECTSAMPLEBLOCK ? TSF_RENDER_EFFECTSAMPLEBLOCK : samples - blockStart);
+		float* outL = buffer + (f->outputmode == TSF_STEREO_INTERLEAVED ? 2 * blockStart : blockStart);
+		float* outR = (f->outputmode == TSF_STEREO_UNWEAVED ? buffer + samples + blockStart : TSF_NULL);
 
-					*outL++ += val * gainMono;
+		for (i = 0; i != f->activeVoiceNum; i++)
+		{
+			k = f->activeVoices[i];
+			if (k % groupCount != group || f->voices[k].finished) continue;
+			tsf_voice_control(f, k, blockSamples, blockStart == 0);
+		}
 
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
-				}
-				break;
+		// Update LFOs.
+		for (i = 0; i != f->activeVoiceNum; i++)
+		{
+			k = f->activeVoices[i];
+			if (k % groupCount != group || f->voices[k].finished) continue;
+			tsf_voice_lfo_process(&c->modLfoLevel[k], &c->modLfoDelta[k], &c->modLfoUntil[k], blockSamples);
+			tsf_voice_lfo_process(&c->vibLfoLevel[k], &c->vibLfoDelta[k], &c->vibLfoUntil[k], blockSamples);
 		}
 
-		if (tmpSourceSamplePosition >= tmpSampleEndDbl || v->ampenv.segment == TSF_SEGMENT_DONE)
+		for (i = 0; i != f->activeVoiceNum; i++)
 		{
-			tsf_voice_kill(v);
-			return;
+			k = f->activeVoices[i];
+			if (k % groupCount != group || f->voices[k].finished) continue;
+			if (buses && (unsigned int)f->voices[k].bus < (unsigned int)busCount)
+			{
+				// Same offsets as outL and outR, in the buffer of the voice's bus
+				float* bus = buses + f->voices[k].bus * busSize;
+				f->voices[k].finished = tsf_voice_render(f, k, bus + (outL - buffer), (outR ? bus + (outR - buffer) : TSF_NULL), blockSamples);
+			}
+			else f->voices[k].finished = tsf_voice_render(f, k, outL, outR, blockSamples);
 		}
 	}
-
-	v->sourceSamplePosition = tmpSourceSamplePosition;
-	if (tmpLowpass.active || dynamicLowpass) v->lowpass = tmpLowpass;
 }
 
-TSFDEF tsf* tsf_load(struct tsf_stream* stream)
+static tsf* tsf_load_internal(struct tsf_stream* stream, struct tsf_stream_memory* in_place, const struct tsf_preset_key_set* subset, int subsetNum, tsf_u32* deferredSmplPos)
 {
 	tsf* res = TSF_NULL;
 	struct tsf_riffchunk chunkHead;
@@ -1366,8 +2591,14 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 	struct tsf_hydra hydra;
 	void* rawBuffer = TSF_NULL;
 	float* floatBuffer = TSF_NULL;
+	const short* inPlaceBuffer = TSF_NULL;
+	TSF_BOOL smplDeferred = TSF_FALSE;
 	tsf_u32 smplCount = 0;
 
+	#if defined(TSF_NO_STDIO) || defined(STB_VORBIS_INCLUDE_STB_VORBIS_H)
+	(void)deferredSmplPos; // streaming is not supported
+	#endif
+
 	if (!tsf_riffchunk_read(TSF_NULL, &chunkHead, stream) || !TSF_FourCCEquals(chunkHead.id, "sfbk"))
 	{
 		//if (e) *e = TSF_INVALID_NOSF2HEADER;
@@ -1381,6 +2612,9 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 		struct tsf_riffchunk chunk;
 		if (TSF_FourCCEquals(chunkList.id, "pdta"))
 		{
+			#ifdef TSF_HAS_MMAP
+			if (in_place) tsf_madvise(in_place->buffer + in_place->pos, chunkList.size, MADV_WILLNEED);
+			#endif
 			while (tsf_riffchunk_read(&chunkList, &chunk, stream))
 			{
 				#define HandleChunk(chunkName) (TSF_FourCCEquals(chunk.id, #chunkName) && !(chunk.size % chunkName##SizeInFile)) \
@@ -1412,9 +2646,35 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 						#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
 						|| TSF_FourCCEquals(chunk.id, "smpo")
 						#endif
-					) && !rawBuffer && !floatBuffer && chunk.size >= sizeof(short))
+					) && !rawBuffer && !floatBuffer && !inPlaceBuffer && !smplDeferred && chunk.size >= sizeof(short))
 				{
-					if (!tsf_load_samples(&rawBuffer, &floatBuffer, &smplCount, &chunk, stream)) goto out_of_memory;
+					if (in_place && TSF_FourCCEquals(chunk.id, "smpl"))
+					{
+						// Reference the 16-bit samples where they are instead of converting them
+						inPlaceBuffer = (const short*)(in_place->buffer + in_place->pos);
+						smplCount = chunk.size / (unsigned int)sizeof(short);
+						if (!stream->skip(stream->data, chunk.size)) inPlaceBuffer = TSF_NULL;
+					}
+					#if !defined(STB_VORBIS_INCLUDE_STB_VORBIS_H) && !defined(TSF_NO_STDIO)
+					else if (deferredSmplPos && TSF_FourCCEquals(chunk.id, "smpl"))
+					{
+						// Samples get streamed from the file later, only remember where they are (stream data is a FILE*)
+						*deferredSmplPos = (tsf_u32)TSF_FTELL((FILE*)stream->data);
+						smplCount = chunk.size / (unsigned int)sizeof(short);
+						smplDeferred = stream->skip(stream->data, chunk.size);
+					}
+					#endif
+					#ifndef STB_VORBIS_INCLUDE_STB_VORBIS_H
+					else if (subset)
+					{
+						// Keep the 16-bit samples, only the used ranges get converted after the presets are known
+						smplCount = chunk.size / (unsigned int)sizeof(short);
+						rawBuffer = TSF_MALLOC(smplCount * sizeof(short));
+						if (!rawBuffer || !stream->read(stream->data, rawBuffer, smplCount * (unsigned int)sizeof(short))) goto out_of_memory;
+						if (chunk.size > smplCount * sizeof(short)) stream->skip(stream->data, chunk.size - smplCount * (unsigned int)sizeof(short));
+					}
+					#endif
+					else if (!tsf_load_samples(&rawBuffer, &floatBuffer, &smplCount, &chunk, stream)) goto out_of_memory;
 				}
 				else stream->skip(stream->data, chunk.size);
 			}
@@ -1425,21 +2685,43 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 	{
 		//if (e) *e = TSF_INVALID_INCOMPLETE;
 	}
-	else if (!rawBuffer && !floatBuffer)
+	else if (!rawBuffer && !floatBuffer && !inPlaceBuffer && !smplDeferred)
 	{
 		//if (e) *e = TSF_INVALID_NOSAMPLEDATA;
 	}
 	else
 	{
 		#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
-		if (!floatBuffer && !tsf_decode_sf3_samples(rawBuffer, &floatBuffer, &smplCount, &hydra)) goto out_of_memory;
+		if (inPlaceBuffer)
+		{
+			// Compressed samples can't be referenced in place, decode everything like tsf_load does
+			int i;
+			for (i = 0; i != hydra.shdrNum; i++) if (hydra.shdrs[i].sampleType & 0x30) break;
+			if (i != hydra.shdrNum)
+			{
+				smplCount *= (tsf_u32)sizeof(short);
+				if (!tsf_decode_sf3_samples(inPlaceBuffer, &floatBuffer, &smplCount, &hydra)) goto out_of_memory;
+				inPlaceBuffer = TSF_NULL;
+			}
+		}
+		else if (!floatBuffer && !tsf_decode_sf3_samples(rawBuffer, &floatBuffer, &smplCount, &hydra)) goto out_of_memory;
 		#endif
 		res = (tsf*)TSF_MALLOC(sizeof(tsf));
 		if (res) TSF_MEMSET(res, 0, sizeof(tsf));
-		if (!res || !tsf_load_presets(res, &hydra, smplCount)) goto out_of_memory;
+		if (!res || !tsf_load_presets(res, &hydra, smplCount, subset, subsetNum)) goto out_of_memory;
 		res->outSampleRate = 44100.0f;
-		res->fontSamples = floatBuffer;
-		floatBuffer = TSF_NULL; // don't free below
+		res->fontSampleCount = smplCount;
+		if (!tsf_load_region_lookups(res) || !tsf_load_preset_hash(res)) { tsf_close(res); res = TSF_NULL; goto out_of_memory; }
+		if (subset && !inPlaceBuffer)
+		{
+			if (!tsf_load_subset_samples(res, floatBuffer, (floatBuffer ? TSF_NULL : (const short*)rawBuffer), smplCount)) { tsf_close(res); res = TSF_NULL; goto out_of_memory; }
+		}
+		else
+		{
+			res->fontSamples = floatBuffer;
+			res->fontSamples16 = inPlaceBuffer;
+			floatBuffer = TSF_NULL; // don't free below
+		}
 	}
 	if (0)
 	{
@@ -1455,6 +2737,371 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 	return res;
 }
 
+TSFDEF tsf* tsf_load(struct tsf_stream* stream)
+{
+	return tsf_load_internal(stream, TSF_NULL, TSF_NULL, 0, TSF_NULL);
+}
+
+TSFDEF tsf* tsf_load_subset(struct tsf_stream* stream, const struct tsf_preset_key_set* needed, int needed_count)
+{
+	return tsf_load_internal(stream, TSF_NULL, needed, needed_count, TSF_NULL);
+}
+
+#ifndef TSF_NO_STDIO
+TSFDEF tsf* tsf_load_filename_streaming(const char* filename, int resident_ms, int max_streams, int buffer_ms)
+{
+	#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+	(void)resident_ms; (void)max_streams; (void)buffer_ms;
+	return tsf_load_filename(filename);
+	#else
+	tsf* res;
+	tsf_u32 smplPos = 0;
+	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_stdio_read, (int(*)(void*,unsigned int))&tsf_stream_stdio_skip };
+	#if __STDC_WANT_SECURE_LIB__
+	FILE* f = TSF_NULL; fopen_s(&f, filename, "rb");
+	#else
+	FILE* f = fopen(filename, "rb");
+	#endif
+	if (!f) return TSF_NULL;
+	stream.data = f;
+	res = tsf_load_internal(&stream, TSF_NULL, TSF_NULL, 0, &smplPos);
+	if (!res) { fclose(f); return TSF_NULL; }
+	if (!tsf_disk_setup(res, f, smplPos, resident_ms, max_streams, buffer_ms))
+	{
+		if (!res->disk) fclose(f); // otherwise closed by tsf_close
+		tsf_close(res);
+		return TSF_NULL;
+	}
+	return res;
+	#endif
+}
+
+TSFDEF int tsf_disk_service(tsf* f)
+{
+	#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+	(void)f;
+	return 0;
+	#else
+	struct tsf_disk* d = f->disk;
+	int i, total = 0;
+	if (!d) return 0;
+	for (i = 0; i != d->slotNum; i++)
+	{
+		struct tsf_disk_slot* s = d->slots + i;
+		int state = TSF_ATOMIC_LOAD(&s->state), filled, consumed, num, first;
+		unsigned int pos, ringPos;
+		if (state == TSF_DISK_RELEASED) { TSF_ATOMIC_STORE(&s->state, TSF_DISK_IDLE); continue; }
+		if (state != TSF_DISK_ACTIVE) continue;
+
+		// Fill up to a ring buffer ahead of the voice, skip what it already went past without the data
+		filled = s->filled;
+		consumed = TSF_ATOMIC_LOAD(&s->consumed);
+		if (consumed > filled) filled = consumed;
+		num = consumed + (int)d->ringMask + 1 - filled;
+		if (num > (int)(s->stop - s->start) - filled) num = (int)(s->stop - s->start) - filled;
+		if (num > TSF_DISK_READSIZE) num = TSF_DISK_READSIZE;
+		if (num <= 0) continue;
+
+		// Read in up to two parts when wrapping around the end of the ring buffer
+		pos = s->start + (unsigned int)filled;
+		ringPos = pos & d->ringMask;
+		first = (int)(d->ringMask + 1 - ringPos);
+		if (first > num) first = num;
+		tsf_disk_read(d, s->ring + ringPos, pos, first);
+		if (first != num) tsf_disk_read(d, s->ring, pos + (unsigned int)first, num - first);
+		TSF_ATOMIC_STORE(&s->filled, filled + num);
+		total += num;
+	}
+	return total;
+	#endif
+}
+
+TSFDEF unsigned int tsf_disk_get_underruns(const tsf* f)
+{
+	return (f->disk ? (unsigned int)TSF_ATOMIC_LOAD(&f->disk->underruns) : 0);
+}
+
+#define TSF_CACHE_VERSION 2
+#define TSF_CACHE_ALIGN 64
+#define TSF_CACHE_SAMPLEPAD 64 // zero samples after the sample data
+
+struct tsf_cache_header
+{
+	char magic[4];
+	tsf_u32 version, layout;
+	tsf_u32 key[3]; // RIFF size, hydra size and hash of the hydra data of the .sf2 file
+	tsf_u32 presetNum, regionNum, sampleCount;
+	tsf_u32 presetsOffset, regionsOffset, samplesOffset, totalSize;
+};
+
+static tsf_u32 tsf_cache_layout(void)
+{
+	static const tsf_u16 byteOrder = 1;
+	return (tsf_u32)(sizeof(struct tsf_region) | (sizeof(struct tsf_preset) << 12) | (sizeof(void*) << 24)) | ((tsf_u32)*(const tsf_u8*)&byteOrder << 31);
+}
+
+static tsf_u32 tsf_cache_align(tsf_u32 pos)
+{
+	return (pos + TSF_CACHE_ALIGN - 1) & ~(tsf_u32)(TSF_CACHE_ALIGN - 1);
+}
+
+static int tsf_cache_key(const char* sf2_filename, tsf_u32 key[3])
+{
+	// Hash the pdta list, every preset, instrument and sample header is in there
+	struct tsf_riffchunk chunkHead, chunkList;
+	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_stdio_read, (int(*)(void*,unsigned int))&tsf_stream_stdio_skip };
+	unsigned char buf[1024];
+	#if __STDC_WANT_SECURE_LIB__
+	FILE* f = TSF_NULL; fopen_s(&f, sf2_filename, "rb");
+	#else
+	FILE* f = fopen(sf2_filename, "rb");
+	#endif
+	if (!f) return 0;
+	stream.data = f;
+	key[0] = key[1] = 0;
+	key[2] = 2166136261u; // FNV-1a
+	if (tsf_riffchunk_read(TSF_NULL, &chunkHead, &stream) && TSF_FourCCEquals(chunkHead.id, "sfbk"))
+	{
+		key[0] = chunkHead.size;
+		while (tsf_riffchunk_read(&chunkHead, &chunkList, &stream))
+		{
+			tsf_u32 left, num, i;
+			if (!TSF_FourCCEquals(chunkList.id, "pdta")) { if (!stream.skip(stream.data, chunkList.size)) break; continue; }
+			for (key[1] = left = chunkList.size; left; left -= num)
+			{
+				num = (left > sizeof(buf) ? (tsf_u32)sizeof(buf) : left);
+				if ((tsf_u32)stream.read(stream.data, buf, num) != num) { key[1] = 0; break; }
+				for (i = 0; i != num; i++) key[2] = (key[2] ^ buf[i]) * 16777619u;
+			}
+			break;
+		}
+	}
+	fclose(f);
+	return (key[1] != 0);
+}
+
+static int tsf_cache_write(FILE* file, const void* data, tsf_u32 size, tsf_u32* pos)
+{
+	*pos += size;
+	return (fwrite(data, 1, size, file) == size);
+}
+
+static int tsf_cache_pad(FILE* file, tsf_u32 target, tsf_u32* pos)
+{
+	static const char zeros[TSF_CACHE_ALIGN] = { 0 };
+	while (*pos < target)
+		if (!tsf_cache_write(file, zeros, (target - *pos > TSF_CACHE_ALIGN ? TSF_CACHE_ALIGN : target - *pos), pos)) return 0;
+	return 1;
+}
+
+TSFDEF int tsf_save_cache(const tsf* f, const char* cache_filename, const char* sf2_filename, int with_samples)
+{
+	struct tsf_cache_header h;
+	struct tsf_preset* preset, *presetEnd = f->presets + f->presetNum;
+	tsf_u32 pos = 0, regionIndex = 0;
+	int ok = 1;
+	FILE* file;
+
+	if (with_samples && !f->fontSamples && !f->fontSamples16) return 0; // streaming instances don't have them
+	if (!with_samples && f->samplesCompacted) return 0; // region offsets don't match the .sf2 samples anymore
+	TSF_MEMSET(&h, 0, sizeof(h));
+	if (!tsf_cache_key(sf2_filename, h.key)) return 0;
+	TSF_MEMCPY(h.magic, "TSFC", 4);
+	h.version = TSF_CACHE_VERSION;
+	h.layout = tsf_cache_layout();
+	h.presetNum = (tsf_u32)f->presetNum;
+	for (preset = f->presets; preset != presetEnd; preset++) h.regionNum += (tsf_u32)preset->regionNum;
+	h.sampleCount = (with_samples ? f->fontSampleCount : 0);
+	h.presetsOffset = tsf_cache_align((tsf_u32)sizeof(h));
+	h.regionsOffset = tsf_cache_align(h.presetsOffset + h.presetNum * (tsf_u32)sizeof(struct tsf_preset));
+	h.samplesOffset = tsf_cache_align(h.regionsOffset + h.regionNum * (tsf_u32)sizeof(struct tsf_region));
+	h.totalSize = h.samplesOffset + (h.sampleCount ? (h.sampleCount + TSF_CACHE_SAMPLEPAD) * (tsf_u32)sizeof(float) : 0);
+
+	#if __STDC_WANT_SECURE_LIB__
+	file = TSF_NULL; fopen_s(&file, cache_filename, "wb");
+	#else
+	file = fopen(cache_filename, "wb");
+	#endif
+	if (!file) return 0;
+	ok = tsf_cache_write(file, &h, (tsf_u32)sizeof(h), &pos) && tsf_cache_pad(file, h.presetsOffset, &pos);
+
+	// Presets store the index of their first region in place of the pointer
+	for (preset = f->presets; ok && preset != presetEnd; preset++)
+	{
+		struct tsf_preset stored = *preset;
+		stored.regions = (struct tsf_region*)(size_t)regionIndex;
+		stored.lookup = TSF_NULL; // rebuilt on load
+		regionIndex += (tsf_u32)preset->regionNum;
+		ok = tsf_cache_write(file, &stored, (tsf_u32)sizeof(stored), &pos);
+	}
+	ok = ok && tsf_cache_pad(file, h.regionsOffset, &pos);
+	for (preset = f->presets; ok && preset != presetEnd; preset++)
+		ok = tsf_cache_write(file, preset->regions, (tsf_u32)(preset->regionNum * sizeof(struct tsf_region)), &pos);
+	ok = ok && tsf_cache_pad(file, h.samplesOffset, &pos);
+
+	if (ok && h.sampleCount)
+	{
+		if (f->fontSamples) ok = tsf_cache_write(file, f->fontSamples, h.sampleCount * (tsf_u32)sizeof(float), &pos);
+		else
+		{
+			float buf[256];
+			tsf_u32 i, j, num;
+			for (i = 0; ok && i < h.sampleCount; i += num)
+			{
+				num = (h.sampleCount - i > 256 ? 256 : h.sampleCount - i);
+				for (j = 0; j != num; j++) buf[j] = (float)(f->fontSamples16[i + j] / 32767.0);
+				ok = tsf_cache_write(file, buf, num * (tsf_u32)sizeof(float), &pos);
+			}
+		}
+		ok = ok && tsf_cache_pad(file, h.totalSize, &pos);
+	}
+	if (fclose(file)) ok = 0;
+	if (!ok) remove(cache_filename);
+	return ok;
+}
+
+#ifdef TSF_HAS_MMAP
+static int tsf_cache_map_samples(tsf* res, const char* sf2_filename)
+{
+	// Reference the 16-bit samples of the .sf2 file in place like tsf_load_filename_mapped
+	struct tsf_riffchunk chunkHead, chunkList, chunk;
+	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_memory_read, (int(*)(void*,unsigned int))&tsf_stream_memory_skip };
+	struct tsf_stream_memory m = { 0, 0, 0 };
+	struct stat st;
+	void* map;
+	int fd = open(sf2_filename, O_RDONLY);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) || st.st_size <= 0 || (unsigned long long)st.st_size > 0xFFFFFFFFu) { close(fd); return 0; }
+	map = mmap(TSF_NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+	tsf_madvise(map, (size_t)st.st_size, MADV_RANDOM);
+	m.buffer = (const char*)map;
+	m.total = (unsigned int)st.st_size;
+	stream.data = &m;
+	if (tsf_riffchunk_read(TSF_NULL, &chunkHead, &stream) && TSF_FourCCEquals(chunkHead.id, "sfbk"))
+	{
+		while (!res->fontSamples16 && tsf_riffchunk_read(&chunkHead, &chunkList, &stream))
+		{
+			if (!TSF_FourCCEquals(chunkList.id, "sdta")) { if (!stream.skip(stream.data, chunkList.size)) break; continue; }
+			while (tsf_riffchunk_read(&chunkList, &chunk, &stream))
+			{
+				if (TSF_FourCCEquals(chunk.id, "smpl"))
+				{
+					res->fontSamples16 = (const short*)(m.buffer + m.pos);
+					res->fontSampleCount = chunk.size / (unsigned int)sizeof(short);
+					break;
+				}
+				if (!stream.skip(stream.data, chunk.size)) break;
+			}
+		}
+	}
+	if (!res->fontSamples16) { munmap(map, (size_t)st.st_size); return 0; }
+	res->mapBase = map;
+	res->mapSize = (size_t)st.st_size;
+	return 1;
+}
+#endif
+
+TSFDEF tsf* tsf_load_cache(const char* cache_filename, const char* sf2_filename)
+{
+	tsf_u32 key[3], i;
+	const struct tsf_cache_header* h;
+	struct tsf_region* regions;
+	char* base;
+	size_t size;
+	int mapped;
+	tsf* res;
+
+	if (!tsf_cache_key(sf2_filename, key)) return TSF_NULL;
+	{
+		#ifdef TSF_HAS_MMAP
+		// Private writable mapping, only the pages of the presets get copied by fixing up their pointers
+		struct stat st;
+		int fd = open(cache_filename, O_RDONLY);
+		if (fd < 0) return TSF_NULL;
+		if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct tsf_cache_header) || (unsigned long long)st.st_size > 0xFFFFFFFFu) { close(fd); return TSF_NULL; }
+		size = (size_t)st.st_size;
+		base = (char*)mmap(TSF_NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (base == (char*)MAP_FAILED) return TSF_NULL;
+		mapped = 1;
+		#else
+		long fileSize;
+		#if __STDC_WANT_SECURE_LIB__
+		FILE* file = TSF_NULL; fopen_s(&file, cache_filename, "rb");
+		#else
+		FILE* file = fopen(cache_filename, "rb");
+		#endif
+		if (!file) return TSF_NULL;
+		if (fseek(file, 0, SEEK_END) || (fileSize = ftell(file)) < (long)sizeof(struct tsf_cache_header) || fseek(file, 0, SEEK_SET)) { fclose(file); return TSF_NULL; }
+		size = (size_t)fileSize;
+		base = (char*)TSF_MALLOC(size);
+		if (!base || fread(base, 1, size, file) != size) { fclose(file); TSF_FREE(base); return TSF_NULL; }
+		fclose(file);
+		mapped = 0;
+		#endif
+	}
+
+	h = (const struct tsf_cache_header*)base;
+	res = TSF_NULL;
+	if (!TSF_FourCCEquals(h->magic, "TSFC") || h->version != TSF_CACHE_VERSION || h->layout != tsf_cache_layout()
+		|| h->key[0] != key[0] || h->key[1] != key[1] || h->key[2] != key[2] || h->totalSize != size
+		|| h->presetsOffset + (size_t)h->presetNum * sizeof(struct tsf_preset) > h->regionsOffset
+		|| h->regionsOffset + (size_t)h->regionNum * sizeof(struct tsf_region) > h->samplesOffset
+		|| h->samplesOffset + (size_t)h->sampleCount * sizeof(float) > h->totalSize) goto fail;
+	res = (tsf*)TSF_MALLOC(sizeof(tsf));
+	if (!res) goto fail;
+	TSF_MEMSET(res, 0, sizeof(tsf));
+	res->presets = (struct tsf_preset*)(base + h->presetsOffset);
+	res->presetNum = (int)h->presetNum;
+	regions = (struct tsf_region*)(base + h->regionsOffset);
+	for (i = 0; i != h->presetNum; i++)
+	{
+		size_t regionIndex = (size_t)res->presets[i].regions;
+		if (res->presets[i].regionNum < 0 || regionIndex + (size_t)res->presets[i].regionNum > h->regionNum) goto fail;
+		res->presets[i].regions = regions + regionIndex;
+		res->presets[i].lookup = TSF_NULL;
+	}
+	res->fontSampleCount = h->sampleCount;
+	if (h->sampleCount) res->fontSamples = (float*)(base + h->samplesOffset);
+	else
+	{
+		// Samples weren't stored, the regions refer to the .sf2 sample data
+		#ifdef TSF_HAS_MMAP
+		if (!tsf_cache_map_samples(res, sf2_filename)) goto fail;
+		#else
+		goto fail;
+		#endif
+	}
+	for (i = 0; i != h->regionNum; i++)
+	{
+		// The render reads samples at these positions without further checks
+		const struct tsf_region* region = regions + i;
+		if (region->offset > res->fontSampleCount || region->end > res->fontSampleCount
+			|| region->loop_start > res->fontSampleCount || region->loop_end > res->fontSampleCount) goto fail;
+	}
+	res->outSampleRate = 44100.0f;
+	res->cacheBase = base;
+	res->cacheSize = size;
+	res->cacheMapped = mapped;
+	if (!tsf_load_region_lookups(res) || !tsf_load_preset_hash(res)) { tsf_close(res); return TSF_NULL; }
+	return res;
+
+	fail:
+	#ifdef TSF_HAS_MMAP
+	if (res && res->mapBase) munmap(res->mapBase, res->mapSize);
+	#endif
+	TSF_FREE(res);
+	#ifdef TSF_HAS_MMAP
+	munmap(base, size);
+	#else
+	TSF_FREE(base);
+	#endif
+	return TSF_NULL;
+}
+#endif
+
 TSFDEF tsf* tsf_copy(tsf* f)
 {
 	tsf* res;
@@ -1469,8 +3116,17 @@ TSFDEF tsf* tsf_copy(tsf* f)
 	if (!res) return TSF_NULL;
 	TSF_MEMCPY(res, f, sizeof(tsf));
 	res->voices = TSF_NULL;
-	res->voiceNum = 0;
+	res->activeVoices = res->keyVoices = res->stealHeap = TSF_NULL;
+	res->voiceNum = res->activeVoiceNum = res->freeVoice = res->keyVoiceChannelNum = res->stealHeapNum = 0;
+	TSF_MEMSET(res->groupVoices, 0, sizeof(res->groupVoices));
 	res->channels = TSF_NULL;
+	TSF_MEMSET(&res->controls, 0, sizeof(res->controls));
+	res->focusVoiceNum = 0;
+	res->culledVoices = 0;
+	// A table of the original means it may switch to sinc later, the copy gets ready for that too
+	res->sincTable = TSF_NULL;
+	if (f->sincTable) res->sincTable = tsf_sinc_table_create();
+	if (!res->sincTable) tsf_switch_interpolation(res, res->interpolation);
 	(*res->refCount)++;
 	return res;
 }
@@ -1481,35 +3137,82 @@ TSFDEF void tsf_close(tsf* f)
 	if (!f->refCount || !--(*f->refCount))
 	{
 		struct tsf_preset *preset = f->presets, *presetEnd = preset + f->presetNum;
-		for (; preset != presetEnd; preset++) TSF_FREE(preset->regions);
-		TSF_FREE(f->presets);
-		TSF_FREE(f->fontSamples);
+		int i;
+		for (; preset != presetEnd; preset++) TSF_FREE(preset->lookup);
+		if (f->cacheBase)
+		{
+			#ifdef TSF_HAS_MMAP
+			if (f->cacheMapped) munmap(f->cacheBase, f->cacheSize);
+			else
+			#endif
+			TSF_FREE(f->cacheBase);
+		}
+		else
+		{
+			for (preset = f->presets; preset != presetEnd; preset++) TSF_FREE(preset->regions);
+			TSF_FREE(f->presets);
+			TSF_FREE(f->fontSamples);
+		}
+		tsf_disk_free(f->disk);
+		TSF_FREE(f->presetHash);
+		for (i = 0; i != TSF_MIPLEVELS; i++) TSF_FREE(f->mipSamples[i]);
+		#ifdef TSF_HAS_MMAP
+		if (f->mapBase) munmap(f->mapBase, f->mapSize);
+		#endif
 		TSF_FREE(f->refCount);
 	}
 	TSF_FREE(f->channels);
 	TSF_FREE(f->voices);
+	TSF_FREE(f->activeVoices);
+	TSF_FREE(f->keyVoices);
+	TSF_FREE(f->stealHeap);
+	tsf_voice_controls_free(&f->controls);
+	TSF_FREE(f->sincTable);
 	TSF_FREE(f);
 }
 
 TSFDEF void tsf_reset(tsf* f)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
+	int i;
+	for (i = 0; i != f->activeVoiceNum; i++)
+	{
+		struct tsf_voice* v = &f->voices[f->activeVoices[i]];
+		if (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release)
 			tsf_voice_endquick(f, v);
+	}
 	if (f->channels) { TSF_FREE(f->channels); f->channels = TSF_NULL; }
+	if (f->stealPolicy == TSF_STEAL_CHANNEL_PRIORITY) tsf_voice_heap_rebuild(f);
 }
 
 TSFDEF int tsf_get_presetindex(const tsf* f, int bank, int preset_number)
 {
-	const struct tsf_preset *presets;
-	int i, iMax;
-	for (presets = f->presets, i = 0, iMax = f->presetNum; i < iMax; i++)
-		if (presets[i].preset == preset_number && presets[i].bank == bank)
-			return i;
+	const struct tsf_preset *preset;
+	int slot, i;
+	if (bank < 0 || bank > 0xFFFF || preset_number < 0 || preset_number > 0xFFFF) return -1;
+	for (slot = TSF_PRESETHASH(bank, preset_number) & f->presetHashMask; (i = f->presetHash[slot]) != 0; slot = (slot + 1) & f->presetHashMask)
+	{
+		preset = &f->presets[i - 1];
+		if (preset->preset == preset_number && preset->bank == bank)
+			return i - 1;
+	}
 	return -1;
 }
 
+TSFDEF int tsf_get_presetindex_fallback(const tsf* f, int bank, int preset_number, int flag_mididrums)
+{
+	int preset_index;
+	if (flag_mididrums)
+	{
+		preset_index = tsf_get_presetindex(f, 128 | bank, preset_number);
+		if (preset_index == -1) preset_index = tsf_get_presetindex(f, 128, preset_number);
+		if (preset_index == -1) preset_index = tsf_get_presetindex(f, 128, 0);
+		if (preset_index == -1) preset_index = tsf_get_presetindex(f, bank, preset_number);
+	}
+	else preset_index = tsf_get_presetindex(f, bank, preset_number);
+	if (preset_index == -1) preset_index = tsf_get_presetindex(f, 0, preset_number);
+	return preset_index;
+}
+
 TSFDEF int tsf_get_presetcount(const tsf* f)
 {
 	return f->presetNum;
@@ -1525,6 +3228,195 @@ TSFDEF const char* tsf_bank_get_presetname(const tsf* f, int bank, int preset_nu
 	return tsf_get_presetname(f, tsf_get_presetindex(f, bank, preset_number));
 }
 
+TSFDEF void tsf_prefetch_preset(const tsf* f, int preset_index)
+{
+	#ifdef TSF_HAS_MMAP
+	const struct tsf_region *region, *regionEnd;
+	const char* samples;
+	size_t sampleSize;
+	if (preset_index < 0 || preset_index >= f->presetNum) return;
+	if (f->mapBase && f->fontSamples16) samples = (const char*)f->fontSamples16, sampleSize = sizeof(short);
+	else if (f->cacheMapped && f->fontSamples) samples = (const char*)f->fontSamples, sampleSize = sizeof(float);
+	else return;
+	for (region = f->presets[preset_index].regions, regionEnd = region + f->presets[preset_index].regionNum; region != regionEnd; region++)
+	{
+		// Voices read from offset up to and including end (the interpolation looks one sample ahead)
+		unsigned int start = region->offset, end = (region->end < f->fontSampleCount ? region->end + 1 : f->fontSampleCount);
+		if (start < end) tsf_madvise(samples + start * sampleSize, (end - start) * sampleSize, MADV_WILLNEED);
+	}
+	#else
+	(void)f; (void)preset_index;
+	#endif
+}
+
+static void tsf_touch_range(const void* ptr, size_t size)
+{
+	const volatile char* p = (const volatile char*)ptr;
+	size_t i;
+	if (!size) return;
+	for (i = 0; i < size; i += 4096) (void)p[i];
+	(void)p[size - 1];
+}
+
+TSFDEF int tsf_warm_up(const tsf* f, const struct tsf_preset_key_set* sets, int set_count)
+{
+	int res = 0;
+	for (; set_count > 0; set_count--, sets++)
+	{
+		const struct tsf_preset* preset;
+		const struct tsf_region *region, *regionEnd;
+		const struct tsf_region_lookup* lookup;
+		int presetIndex = tsf_get_presetindex(f, sets->bank, sets->preset_number), key, level;
+		if (presetIndex < 0) continue;
+		preset = &f->presets[presetIndex];
+		for (region = preset->regions, regionEnd = region + preset->regionNum; region != regionEnd; region++)
+		{
+			// Voices read from offset up to and including end (the interpolation looks one sample ahead)
+			unsigned int start = region->offset, end = (region->end < f->fontSampleCount ? region->end + 1 : f->fontSampleCount);
+			if (start >= end || !tsf_subset_has_keys(sets, region->lokey, region->hikey)) continue;
+			if (f->fontSamples) tsf_touch_range(f->fontSamples + start, (end - start) * sizeof(float));
+			else if (f->fontSamples16) tsf_touch_range(f->fontSamples16 + start, (end - start) * sizeof(short));
+			for (level = 0; level != f->mipLevels; level++)
+				tsf_touch_range(f->mipSamples[level] + (start >> (level + 1)), (((end - start) >> (level + 1)) + 2) * sizeof(float));
+		}
+		if ((lookup = preset->lookup) != TSF_NULL)
+		{
+			for (key = 0; key != 128; key++)
+			{
+				int bucket = key * lookup->layerNum;
+				if (!tsf_subset_has_keys(sets, (unsigned char)key, (unsigned char)key)) continue;
+				tsf_touch_range(lookup->start + bucket, (lookup->layerNum + 1) * sizeof(int));
+				if (lookup->start[bucket + lookup->layerNum] > lookup->start[bucket])
+					tsf_touch_range(lookup->index + lookup->start[bucket], (lookup->start[bucket + lookup->layerNum] - lookup->start[bucket]) * sizeof(int));
+			}
+		}
+		res++;
+	}
+	return res;
+}
+
+TSFDEF int tsf_build_mips(tsf* f, int mip_levels)
+{
+	float taps[TSF_MIPTAPS];
+	double sum = 0;
+	int level, t;
+	if (f->disk || (!f->fontSamples && !f->fontSamples16)) return 0;
+	if (mip_levels > TSF_MIPLEVELS) mip_levels = TSF_MIPLEVELS;
+
+	// Blackman windowed sinc lowpass at half the Nyquist frequency of the level above
+	for (t = 0; t != TSF_MIPTAPS; t++)
+	{
+		double x = t - (TSF_MIPTAPS - 1) / 2;
+		double w = 0.42 + 0.5 * TSF_COS(2 * TSF_PI * x / (TSF_MIPTAPS + 1)) + 0.08 * TSF_COS(4 * TSF_PI * x / (TSF_MIPTAPS + 1));
+		taps[t] = (float)(w * (x == 0 ? 1.0 : TSF_SIN(TSF_PI * 0.5 * x) / (TSF_PI * 0.5 * x)));
+		sum += taps[t];
+	}
+	for (t = 0; t != TSF_MIPTAPS; t++) taps[t] = (float)(taps[t] / sum);
+
+	for (level = f->mipLevels; level < mip_levels; level++)
+	{
+		// The level above has srcNum samples, positions in this level are half of the ones there.
+		// Some zeros at the end cover the one sample the interpolation reads past the sample end.
+		const float* src = (level ? f->mipSamples[level - 1] : f->fontSamples);
+		int srcNum = (int)((f->fontSampleCount + (1u << level) - 1) >> level), num = (srcNum + 1) / 2, i;
+		float* mip = (float*)TSF_MALLOC((num + 4) * sizeof(float));
+		if (!mip) return 0;
+		for (i = 0; i != num; i++)
+		{
+			int first = 2 * i - (TSF_MIPTAPS - 1) / 2, from = (first < 0 ? -first : 0), to = (srcNum - first < TSF_MIPTAPS ? srcNum - first : TSF_MIPTAPS);
+			float acc = 0;
+			if (src) for (t = from; t < to; t++) acc += taps[t] * src[first + t];
+			else for (t = from; t < to; t++) acc += taps[t] * (f->fontSamples16[first + t] * (1.0f / 32767.0f));
+			mip[i] = acc;
+		}
+		TSF_MEMSET(mip + num, 0, 4 * sizeof(float));
+		f->mipSamples[level] = mip;
+		f->mipLevels = level + 1;
+	}
+	return 1;
+}
+
+// Lock a range into RAM, or if that fails touch each of its pages (writing pages back that are written during rendering)
+static int tsf_lock_range(const void* ptr, size_t size, int writable)
+{
+	volatile char* p = (volatile char*)ptr;
+	size_t i;
+	if (!ptr || !size) return 1;
+	#ifdef TSF_HAS_MMAP
+	{
+		size_t page = (size_t)sysconf(_SC_PAGESIZE), misalign = (size_t)ptr & (page - 1);
+		if (!mlock((const char*)ptr - misalign, size + misalign)) return 1;
+	}
+	#endif
+	for (i = 0; i < size; i += 4096) { if (writable) p[i] = p[i]; else (void)p[i]; }
+	if (writable) p[size - 1] = p[size - 1]; else (void)p[size - 1];
+	return 0;
+}
+
+TSFDEF int tsf_lock_memory(tsf* f)
+{
+	int res = 0, ok = 1, level;
+	const struct tsf_preset *preset, *presetEnd = f->presets + f->presetNum;
+	struct tsf_voice_controls* c = &f->controls;
+	size_t voiceNum = (size_t)f->voiceNum;
+
+	if (f->fontSamples) ok &= tsf_lock_range(f->fontSamples, f->fontSampleCount * sizeof(float), 0);
+	if (f->fontSamples16) ok &= tsf_lock_range(f->fontSamples16, f->fontSampleCount * sizeof(short), 0);
+	for (level = 0; level != f->mipLevels; level++)
+	{
+		unsigned int srcNum = (f->fontSampleCount + (1u << level) - 1) >> level;
+		ok &= tsf_lock_range(f->mipSamples[level], ((srcNum + 1) / 2 + 4) * sizeof(float), 0);
+	}
+	if (f->disk)
+	{
+		unsigned int i, residentNum = 0;
+		for (i = 0; i != f->disk->pageNum; i++) if (f->disk->pages[i]) residentNum++;
+		ok &= tsf_lock_range(f->disk->pages, f->disk->pageNum * sizeof(float*), 0);
+		ok &= tsf_lock_range(f->disk->pageData, residentNum * TSF_DISK_PAGESIZE * sizeof(float), 0);
+	}
+	if (ok) res |= TSF_LOCKED_SAMPLES;
+
+	ok = tsf_lock_range(f->presets, f->presetNum * sizeof(struct tsf_preset), 0);
+	ok &= tsf_lock_range(f->presetHash, (f->presetHashMask + 1) * sizeof(int), 0);
+	for (preset = f->presets; preset != presetEnd; preset++)
+	{
+		ok &= tsf_lock_range(preset->regions, preset->regionNum * sizeof(struct tsf_region), 0);
+		if (preset->lookup)
+		{
+			int bucketNum = 128 * preset->lookup->layerNum;
+			ok &= tsf_lock_range(preset->lookup, sizeof(struct tsf_region_lookup) + (bucketNum + 1 + preset->lookup->start[bucketNum]) * sizeof(int), 0);
+		}
+	}
+	if (ok) res |= TSF_LOCKED_PRESETS;
+
+	ok = tsf_lock_range(f, sizeof(tsf), 1);
+	ok &= tsf_lock_range(f->voices, voiceNum * sizeof(struct tsf_voice), 1);
+	ok &= tsf_lock_range(f->activeVoices, voiceNum * sizeof(int), 1);
+	ok &= tsf_lock_range(f->stealHeap, voiceNum * sizeof(int), 1);
+	if (f->keyVoices) ok &= tsf_lock_range(f->keyVoices, (f->keyVoiceChannelNum + 1) * 128 * sizeof(int), 1);
+	#define TSF_CONTROLS_LOCK(type, field) ok &= tsf_lock_range(c->field, voiceNum * sizeof(type), 1);
+	TSF_CONTROLS_LOCK(unsigned char, flags) TSF_CONTROLS_LOCK(unsigned char, lowpassActive)
+	TSF_CONTROLS_LOCK(float, gainLeft) TSF_CONTROLS_LOCK(float, gainRight) TSF_CONTROLS_LOCK(float, noteGain)
+	TSF_CONTROLS_LOCK(double, pitchRatio) TSF_CONTROLS_LOCK(double, lowpassA0) TSF_CONTROLS_LOCK(double, lowpassA1)
+	TSF_CONTROLS_LOCK(double, lowpassB1) TSF_CONTROLS_LOCK(double, lowpassB2)
+	TSF_CONTROLS_LOCK(float, modLfoLevel) TSF_CONTROLS_LOCK(float, modLfoDelta) TSF_CONTROLS_LOCK(int, modLfoUntil)
+	TSF_CONTROLS_LOCK(float, vibLfoLevel) TSF_CONTROLS_LOCK(float, vibLfoDelta) TSF_CONTROLS_LOCK(int, vibLfoUntil)
+	TSF_CONTROLS_LOCK(float, initialFilterFc) TSF_CONTROLS_LOCK(float, modLfoToFilterFc) TSF_CONTROLS_LOCK(float, modEnvToFilterFc)
+	TSF_CONTROLS_LOCK(float, modLfoToPitch) TSF_CONTROLS_LOCK(float, vibLfoToPitch) TSF_CONTROLS_LOCK(float, modEnvToPitch)
+	TSF_CONTROLS_LOCK(float, modLfoToVolume)
+	#undef TSF_CONTROLS_LOCK
+	if (f->sincTable) ok &= tsf_lock_range(f->sincTable, (TSF_SINC_PHASES + 1) * TSF_SINC_TAPS * sizeof(float), 0);
+	if (f->channels) ok &= tsf_lock_range(f->channels, sizeof(struct tsf_channels) + (f->channels->channelNum - 1) * sizeof(struct tsf_channel), 1);
+	if (f->disk)
+	{
+		size_t slotNum = (size_t)(f->disk->slotNum ? f->disk->slotNum : 1);
+		ok &= tsf_lock_range(f->disk->slots, slotNum * sizeof(struct tsf_disk_slot), 1);
+		ok &= tsf_lock_range(f->disk->ringData, slotNum * (f->disk->ringMask + 1) * sizeof(float), 1);
+	}
+	if (ok) res |= TSF_LOCKED_VOICES;
+	return res;
+}
+
 TSFDEF void tsf_set_output(tsf* f, enum TSFOutputMode outputmode, int samplerate, float global_gain_db)
 {
 	f->outputmode = outputmode;
@@ -1539,76 +3431,99 @@ TSFDEF void tsf_set_volume(tsf* f, float global_volume)
 
 TSFDEF int tsf_set_max_voices(tsf* f, int max_voices)
 {
-	int i = f->voiceNum;
 	int newVoiceNum = (f->voiceNum > max_voices ? f->voiceNum : max_voices);
-	struct tsf_voice *newVoices = (struct tsf_voice*)TSF_REALLOC(f->voices, newVoiceNum * sizeof(struct tsf_voice));
-	if (!newVoices) return 0;
-	f->voices = newVoices;
-	f->voiceNum = f->maxVoiceNum = newVoiceNum;
-	for (; i < max_voices; i++)
-		f->voices[i].playingPreset = -1;
+	if (!tsf_voice_grow(f, newVoiceNum)) return 0;
+	f->maxVoiceNum = newVoiceNum;
+	return 1;
+}
+
+TSFDEF void tsf_set_voice_limit(tsf* f, int voice_limit)
+{
+	f->voiceLimit = (voice_limit > 0 ? voice_limit : 0);
+}
+
+TSFDEF void tsf_set_cull_threshold(tsf* f, float threshold_db)
+{
+	f->cullGain = (threshold_db < 0 ? tsf_decibelsToGain(threshold_db) : 0);
+}
+
+TSFDEF unsigned int tsf_get_culled_voices(const tsf* f)
+{
+	return TSF_ATOMIC_LOAD(&f->culledVoices);
+}
+
+TSFDEF void tsf_set_steal_policy(tsf* f, enum TSFStealPolicy policy)
+{
+	f->stealPolicy = policy;
+	tsf_voice_heap_rebuild(f);
+}
+
+TSFDEF int tsf_set_interpolation(tsf* f, enum TSFInterpolation interpolation)
+{
+	if ((interpolation == TSF_INTERPOLATION_SINC || interpolation == TSF_INTERPOLATION_AUTO) && !f->sincTable)
+	{
+		f->sincTable = tsf_sinc_table_create();
+		if (!f->sincTable) return 0;
+	}
+	f->interpolation = interpolation;
 	return 1;
 }
 
+TSFDEF void tsf_switch_interpolation(tsf* f, enum TSFInterpolation interpolation)
+{
+	if ((interpolation == TSF_INTERPOLATION_SINC || interpolation == TSF_INTERPOLATION_AUTO) && !f->sincTable)
+		interpolation = TSF_INTERPOLATION_LINEAR;
+	f->interpolation = interpolation;
+}
+
 TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 {
 	short midiVelocity = (short)(vel * 127);
 	unsigned int voicePlayIndex;
-	struct tsf_region *region, *regionEnd;
+	const struct tsf_region_lookup* lookup;
+	const int *index, *indexEnd;
 
 	if (preset_index < 0 || preset_index >= f->presetNum) return 1;
 	if (vel <= 0.0f) { tsf_note_off(f, preset_index, key); return 1; }
+	if (key < 0 || key > 127 || midiVelocity > 127) return 1;
 
 	// Play all matching regions.
 	voicePlayIndex = f->voicePlayIndex++;
-	for (region = f->presets[preset_index].regions, regionEnd = region + f->presets[preset_index].regionNum; region != regionEnd; region++)
+	lookup = f->presets[preset_index].lookup;
+	index = lookup->index + lookup->start[key * lookup->layerNum + lookup->layer[midiVelocity]];
+	indexEnd = lookup->index + lookup->start[key * lookup->layerNum + lookup->layer[midiVelocity] + 1];
+	for (; index != indexEnd; index++)
 	{
-		struct tsf_voice *voice, *v, *vEnd; TSF_BOOL doLoop; float lowpassFilterQDB, lowpassFc;
-		if (key < region->lokey || key > region->hikey || midiVelocity < region->lovel || midiVelocity > region->hivel) continue;
+		struct tsf_region* region = f->presets[preset_index].regions + *index;
+		struct tsf_voice *voice, *v; TSF_BOOL doLoop; float lowpassFilterQDB, lowpassFc; int i, k;
+		struct tsf_voice_controls* c = &f->controls;
 
-		voice = TSF_NULL, v = f->voices, vEnd = v + f->voiceNum;
 		if (region->group)
 		{
-			for (; v != vEnd; v++)
+			for (i = f->groupVoices[region->group & (TSF_GROUPLISTS - 1)]; i; i = v->groupNext)
+			{
+				v = &f->voices[i - 1];
 				if (v->playingPreset == preset_index && v->region->group == region->group) tsf_voice_endquick(f, v);
-				else if (v->playingPreset == -1 && !voice) voice = v;
+			}
 		}
-		else for (; v != vEnd; v++) if (v->playingPreset == -1) { voice = v; break; }
 
+		voice = (f->voiceLimit && f->activeVoiceNum >= f->voiceLimit ? TSF_NULL : tsf_voice_alloc(f));
 		if (!voice)
 		{
-			if (f->maxVoiceNum)
+			if (f->maxVoiceNum || f->voiceLimit)
 			{
-				// Voices have been pre-allocated and limited to a maximum, try to kill a voice off in its release envelope
-				int bestKillReleaseSamplePos = -999999999;
-				for (v = f->voices; v != vEnd; v++)
-				{
-					if (v->ampenv.segment == TSF_SEGMENT_RELEASE)
-					{
-						// We're looking for the voice furthest into its release
-						int releaseSamplesDone = tsf_voice_envelope_release_samples(&v->ampenv, f->outSampleRate) - v->ampenv.samplesUntilNextSegment;
-						if (releaseSamplesDone > bestKillReleaseSamplePos)
-						{
-							bestKillReleaseSamplePos = releaseSamplesDone;
-							voice = v;
-						}
-					}
-				}
+				// Voices have been pre-allocated and limited to a maximum, stop the one the steal policy picks
+				voice = tsf_voice_steal(f, key, voicePlayIndex);
 				if (!voice)
 					continue;
-				tsf_voice_kill(voice);
+				tsf_voice_kill(f, voice);
 			}
 			else
 			{
 				// Allocate more voices so we don't need to kill one off.
-				struct tsf_voice* newVoices;
-				f->voiceNum += 4;
-				newVoices = (struct tsf_voice*)TSF_REALLOC(f->voices, f->voiceNum * sizeof(struct tsf_voice));
-				if (!newVoices) return 0;
-				f->voices = newVoices;
-				voice = &f->voices[f->voiceNum - 4];
-				voice[1].playingPreset = voice[2].playingPreset = voice[3].playingPreset = -1;
+				if (!tsf_voice_grow(f, f->voiceNum + 4)) return 0;
 			}
+			voice = tsf_voice_alloc(f);
 		}
 
 		voice->region = region;
@@ -1616,7 +3531,12 @@ TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 		voice->playingKey = key;
 		voice->playIndex = voicePlayIndex;
 		voice->heldSustain = 0;
+		voice->finished = 0;
+		voice->releasedInRender = 0;
+		voice->mipLevel = 0;
+		k = (int)(voice - f->voices);
 		voice->noteGainDB = f->globalGainDB - region->attenuation - tsf_gainToDecibels(1.0f / vel);
+		voice->bus = f->noteBus;
 
 		if (f->channels)
 		{
@@ -1624,19 +3544,25 @@ TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 		}
 		else
 		{
+			voice->playingChannel = -1;
 			tsf_voice_calcpitchratio(voice, 0, f->outSampleRate);
 			// The SFZ spec is silent about the pan curve, but a 3dB pan law seems common. This sqrt() curve matches what Dimension LE does; Alchemy Free seems closer to sin(adjustedPan * pi/2).
 			voice->panFactorLeft  = TSF_SQRTF(0.5f - region->pan);
 			voice->panFactorRight = TSF_SQRTF(0.5f + region->pan);
 		}
 
+		tsf_voice_link(f, voice, voice->playingChannel);
+
 		// Offset/end.
 		voice->sourceSamplePosition = region->offset;
+		voice->diskSlot = (f->disk ? tsf_disk_claim(f->disk, region) : TSF_NULL);
 
 		// Loop.
 		doLoop = (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end);
 		voice->loopStart = (doLoop ? region->loop_start : 0);
 		voice->loopEnd = (doLoop ? region->loop_end : 0);
+		tsf_voice_select_mip(f, voice);
+		tsf_voice_select_kernels(f, voice);
 
 		// Setup envelopes.
 		tsf_voice_envelope_setup(&voice->ampenv, &region->ampenv, key, midiVelocity, TSF_TRUE, f->outSampleRate);
@@ -1645,14 +3571,30 @@ TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 		// Setup lowpass filter.
 		lowpassFc = (region->initialFilterFc <= 13500 ? tsf_cents2Hertz((float)region->initialFilterFc) / f->outSampleRate : 1.0f);
 		lowpassFilterQDB = region->initialFilterQ / 10.0f;
-		voice->lowpass.QInv = 1.0 / TSF_POW(10.0, (lowpassFilterQDB / 20.0));
-		voice->lowpass.z1 = voice->lowpass.z2 = 0;
-		voice->lowpass.active = (lowpassFc < 0.499f);
-		if (voice->lowpass.active) tsf_voice_lowpass_setup(&voice->lowpass, lowpassFc);
+		voice->lowpassQInv = 1.0 / TSF_POW(10.0, (lowpassFilterQDB / 20.0));
+		voice->lowpassZ1 = voice->lowpassZ2 = 0;
+		c->lowpassActive[k] = (lowpassFc < 0.499f);
+		if (c->lowpassActive[k]) tsf_voice_lowpass_setup(c, k, voice->lowpassQInv, TSF_TAN(TSF_PI * lowpassFc));
 
 		// Setup LFO filters.
-		tsf_voice_lfo_setup(&voice->modlfo, region->delayModLFO, region->freqModLFO, f->outSampleRate);
-		tsf_voice_lfo_setup(&voice->viblfo, region->delayVibLFO, region->freqVibLFO, f->outSampleRate);
+		tsf_voice_lfo_setup(&c->modLfoLevel[k], &c->modLfoDelta[k], &c->modLfoUntil[k], region->delayModLFO, region->freqModLFO, f->outSampleRate);
+		tsf_voice_lfo_setup(&c->vibLfoLevel[k], &c->vibLfoDelta[k], &c->vibLfoUntil[k], region->delayVibLFO, region->freqVibLFO, f->outSampleRate);
+
+		// Copy what the control pass needs so it doesn't have to look at the region
+		c->flags[k] = (unsigned char)(((region->modLfoToFilterFc || region->modEnvToFilterFc) ? TSF_CONTROL_LOWPASS : 0)
+			| ((region->modLfoToPitch || region->modEnvToPitch || region->vibLfoToPitch) ? TSF_CONTROL_PITCH : 0)
+			| (region->modLfoToVolume ? TSF_CONTROL_GAIN : 0)
+			| ((region->modEnvToPitch || region->modEnvToFilterFc) ? TSF_CONTROL_MODENV : 0));
+		c->initialFilterFc[k] = (float)region->initialFilterFc;
+		c->modLfoToFilterFc[k] = (float)region->modLfoToFilterFc;
+		c->modEnvToFilterFc[k] = (float)region->modEnvToFilterFc;
+		c->modLfoToPitch[k] = (float)region->modLfoToPitch;
+		c->vibLfoToPitch[k] = (float)region->vibLfoToPitch;
+		c->modEnvToPitch[k] = (float)region->modEnvToPitch;
+		c->modLfoToVolume[k] = (float)region->modLfoToVolume * 0.1f;
+
+		// Its place in the steal heap depends on the envelope and gain set up above
+		tsf_voice_heap_push(f, voice);
 	}
 	return 1;
 }
@@ -1666,21 +3608,29 @@ TSFDEF int tsf_bank_note_on(tsf* f, int bank, int preset_number, int key, float
 
 TSFDEF void tsf_note_off(tsf* f, int preset_index, int key)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum, *vMatchFirst = TSF_NULL, *vMatchLast = TSF_NULL;
-	for (; v != vEnd; v++)
+	struct tsf_voice *v, *vMatch = TSF_NULL;
+	int channel, i;
+	if (key < 0 || key > 127 || !f->keyVoices) return;
+	for (channel = -1; channel != f->keyVoiceChannelNum; channel++)
 	{
-		//Find the first and last entry in the voices list with matching preset, key and look up the smallest play index
-		if (v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
-		else if (!vMatchFirst || v->playIndex < vMatchFirst->playIndex) vMatchFirst = vMatchLast = v;
-		else if (v->playIndex == vMatchFirst->playIndex) vMatchLast = v;
+		//Find the voice with matching preset, key and the smallest play index
+		for (i = f->keyVoices[(channel + 1) * 128 + key]; i; i = v->keyNext)
+		{
+			v = &f->voices[i - 1];
+			if (v->playingPreset != preset_index || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
+			if (!vMatch || v->playIndex < vMatch->playIndex) vMatch = v;
+		}
 	}
-	if (!vMatchFirst) return;
-	for (v = vMatchFirst; v <= vMatchLast; v++)
+	if (!vMatch) return;
+	for (channel = -1; channel != f->keyVoiceChannelNum; channel++)
 	{
 		//Stop all voices with matching preset, key and the smallest play index which was enumerated above
-		if (v != vMatchFirst && v != vMatchLast &&
-			(v->playIndex != vMatchFirst->playIndex || v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE)) continue;
-		tsf_voice_end(f, v);
+		for (i = f->keyVoices[(channel + 1) * 128 + key]; i; i = v->keyNext)
+		{
+			v = &f->voices[i - 1];
+			if (v->playIndex != vMatch->playIndex || v->playingPreset != preset_index || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
+			tsf_voice_end(f, v);
+		}
 	}
 }
 
@@ -1694,17 +3644,15 @@ TSFDEF int tsf_bank_note_off(tsf* f, int bank, int preset_number, int key)
 
 TSFDEF void tsf_note_off_all(tsf* f)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) if (v->playingPreset != -1 && v->ampenv.segment < TSF_SEGMENT_RELEASE)
-		tsf_voice_end(f, v);
+	int i;
+	for (i = 0; i != f->activeVoiceNum; i++)
+		if (f->voices[f->activeVoices[i]].ampenv.segment < TSF_SEGMENT_RELEASE)
+			tsf_voice_end(f, &f->voices[f->activeVoices[i]]);
 }
 
 TSFDEF int tsf_active_voice_count(tsf* f)
 {
-	int count = 0;
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) if (v->playingPreset != -1) count++;
-	return count;
+	return f->activeVoiceNum;
 }
 
 TSFDEF void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing)
@@ -1737,11 +3685,45 @@ TSFDEF void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing
 
 TSFDEF void tsf_render_float(tsf* f, float* buffer, int samples, int flag_mixing)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
 	if (!flag_mixing) TSF_MEMSET(buffer, 0, (f->outputmode == TSF_MONO ? 1 : 2) * sizeof(float) * samples);
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1)
-			tsf_voice_render(f, v, buffer, samples);
+	tsf_render_voices(f, 0, 1, buffer, TSF_NULL, 0, samples);
+	tsf_render_groups_finish(f);
+}
+
+TSFDEF void tsf_render_float_buses(tsf* f, float* buffer, float* buses, int bus_count, int samples, int flag_mixing)
+{
+	int busSize = (f->outputmode == TSF_MONO ? 1 : 2) * samples, b, i;
+	if (!flag_mixing) TSF_MEMSET(buffer, 0, busSize * sizeof(float));
+	if (bus_count > 0) TSF_MEMSET(buses, 0, (size_t)bus_count * busSize * sizeof(float));
+	tsf_render_voices(f, 0, 1, buffer, buses, bus_count, samples);
+	for (b = 0; b != bus_count; b++, buses += busSize)
+		for (i = 0; i != busSize; i++) buffer[i] += buses[i];
+	tsf_render_groups_finish(f);
+}
+
+TSFDEF void tsf_set_note_bus(tsf* f, int bus)
+{
+	f->noteBus = bus;
+}
+
+TSFDEF void tsf_render_float_group(tsf* f, int group, int group_count, float* buffer, int samples, int flag_mixing)
+{
+	// Voices always belong to the same group and render in active list order, which only
+	// changes on the thread calling note on/off and tsf_render_groups_finish
+	if (!flag_mixing) TSF_MEMSET(buffer, 0, (f->outputmode == TSF_MONO ? 1 : 2) * sizeof(float) * samples);
+	tsf_render_voices(f, group, group_count, buffer, TSF_NULL, 0, samples);
+}
+
+TSFDEF void tsf_render_groups_finish(tsf* f)
+{
+	int i = 0;
+	while (i < f->activeVoiceNum)
+	{
+		struct tsf_voice* v = &f->voices[f->activeVoices[i]];
+		if (v->finished) { tsf_voice_kill(f, v); continue; } // the last active voice takes its place
+		if (v->releasedInRender) { v->releasedInRender = 0; tsf_voice_released(f, v, TSF_FALSE); }
+		i++;
+	}
 }
 
 static void tsf_channel_setup_voice(tsf* f, struct tsf_voice* v)
@@ -1749,6 +3731,7 @@ static void tsf_channel_setup_voice(tsf* f, struct tsf_voice* v)
 	struct tsf_channel* c = &f->channels->channels[f->channels->activeChannel];
 	float newpan = v->region->pan + c->panOffset;
 	v->playingChannel = f->channels->activeChannel;
+	v->bus = f->channels->activeChannel;
 	v->noteGainDB += c->gainDB;
 	tsf_voice_calcpitchratio(v, (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning)), f->outSampleRate);
 	if      (newpan <= -0.5f) { v->panFactorLeft = 1.0f; v->panFactorRight = 0.0f; }
@@ -1760,6 +3743,7 @@ static struct tsf_channel* tsf_channel_init(tsf* f, int channel)
 {
 	int i;
 	if (f->channels && channel < f->channels->channelNum) return &f->channels->channels[channel];
+	if (!tsf_voice_keylists_grow(f, channel + 1)) return TSF_NULL;
 	if (!f->channels)
 	{
 		f->channels = (struct tsf_channels*)TSF_MALLOC(sizeof(struct tsf_channels) + sizeof(struct tsf_channel) * channel);
@@ -1783,22 +3767,23 @@ static struct tsf_channel* tsf_channel_init(tsf* f, int channel)
 		c->pitchWheel = c->midiPan = 8192;
 		c->midiVolume = c->midiExpression = 16383;
 		c->midiRPN = 0xFFFF;
-		c->midiData = c->sustain = 0;
+		c->midiData = c->sustain = c->focus = 0;
 		c->panOffset = 0.0f;
 		c->gainDB = 0.0f;
 		c->pitchRange = 2.0f;
 		c->tuning = 0.0f;
+		c->stealPriority = 0;
 	}
 	return &f->channels->channels[channel];
 }
 
 static void tsf_channel_applypitch(tsf* f, int channel, struct tsf_channel* c)
 {
-	struct tsf_voice *v, *vEnd;
+	int i;
 	float pitchShift = (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning));
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel)
-			tsf_voice_calcpitchratio(v, pitchShift, f->outSampleRate);
+	for (i = 0; i != f->activeVoiceNum; i++)
+		if (f->voices[f->activeVoices[i]].playingChannel == channel)
+			tsf_voice_calcpitchratio(&f->voices[f->activeVoices[i]], pitchShift, f->outSampleRate);
 }
 
 TSFDEF int tsf_channel_set_presetindex(tsf* f, int channel, int preset_index)
@@ -1814,15 +3799,7 @@ TSFDEF int tsf_channel_set_presetnumber(tsf* f, int channel, int preset_number,
 	int preset_index;
 	struct tsf_channel *c = tsf_channel_init(f, channel);
 	if (!c) return 0;
-	if (flag_mididrums)
-	{
-		preset_index = tsf_get_presetindex(f, 128 | (c->bank & 0x7FFF), preset_number);
-		if (preset_index == -1) preset_index = tsf_get_presetindex(f, 128, preset_number);
-		if (preset_index == -1) preset_index = tsf_get_presetindex(f, 128, 0);
-		if (preset_index == -1) preset_index = tsf_get_presetindex(f, (c->bank & 0x7FFF), preset_number);
-	}
-	else preset_index = tsf_get_presetindex(f, (c->bank & 0x7FFF), preset_number);
-	if (preset_index == -1) preset_index = tsf_get_presetindex(f, 0, preset_number);
+	preset_index = tsf_get_presetindex_fallback(f, (c->bank & 0x7FFF), preset_number, flag_mididrums);
 	if (preset_index != -1)
 	{
 		c->presetIndex = (unsigned short)preset_index;
@@ -1853,17 +3830,20 @@ TSFDEF int tsf_channel_set_bank_preset(tsf* f, int channel, int bank, int preset
 
 TSFDEF int tsf_channel_set_pan(tsf* f, int channel, float pan)
 {
-	struct tsf_voice *v, *vEnd;
+	int i;
 	struct tsf_channel *c = tsf_channel_init(f, channel);
 	if (!c) return 0;
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel)
+	for (i = 0; i != f->activeVoiceNum; i++)
+	{
+		struct tsf_voice* v = &f->voices[f->activeVoices[i]];
+		if (v->playingChannel == channel)
 		{
 			float newpan = v->region->pan + pan - 0.5f;
 			if      (newpan <= -0.5f) { v->panFactorLeft = 1.0f; v->panFactorRight = 0.0f; }
 			else if (newpan >=  0.5f) { v->panFactorLeft = 0.0f; v->panFactorRight = 1.0f; }
 			else { v->panFactorLeft = TSF_SQRTF(0.5f - newpan); v->panFactorRight = TSF_SQRTF(0.5f + newpan); }
 		}
+	}
 	c->panOffset = pan - 0.5f;
 	return 1;
 }
@@ -1871,14 +3851,15 @@ TSFDEF int tsf_channel_set_pan(tsf* f, int channel, float pan)
 TSFDEF int tsf_channel_set_volume(tsf* f, int channel, float volume)
 {
 	float gainDB = tsf_gainToDecibels(volume), gainDBChange;
-	struct tsf_voice *v, *vEnd;
+	int i;
 	struct tsf_channel *c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (gainDB == c->gainDB) return 1;
-	for (v = f->voices, vEnd = v + f->voiceNum, gainDBChange = gainDB - c->gainDB; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel)
-			v->noteGainDB += gainDBChange;
+	for (i = 0, gainDBChange = gainDB - c->gainDB; i != f->activeVoiceNum; i++)
+		if (f->voices[f->activeVoices[i]].playingChannel == channel)
+			f->voices[f->activeVoices[i]].noteGainDB += gainDBChange;
 	c->gainDB = gainDB;
+	if (f->stealPolicy == TSF_STEAL_QUIETEST) tsf_voice_heap_rebuild(f);
 	return 1;
 }
 
@@ -1914,6 +3895,8 @@ TSFDEF int tsf_channel_set_tuning(tsf* f, int channel, float tuning)
 
 TSFDEF int tsf_channel_set_sustain(tsf* f, int channel, int flag_sustain)
 {
+	int i, key;
+	struct tsf_voice* v;
 	struct tsf_channel *c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (!c->sustain == !flag_sustain) return 1;
@@ -1921,10 +3904,33 @@ TSFDEF int tsf_channel_set_sustain(tsf* f, int channel, int flag_sustain)
 	//Turning on sustain does no action now, just starts note_off behaving differently
 	if (flag_sustain) return 1;
 	//Turning off sustain, actually end voices that got a note_off and were set to heldSustain status
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && v->ampenv.segment < TSF_SEGMENT_RELEASE && v->heldSustain)
-			tsf_voice_end(f, v);
+	for (key = 0; key != 128; key++)
+	{
+		for (i = f->keyVoices[(channel + 1) * 128 + key]; i; i = v->keyNext)
+		{
+			v = &f->voices[i - 1];
+			if (v->ampenv.segment < TSF_SEGMENT_RELEASE && v->heldSustain)
+				tsf_voice_end(f, v);
+		}
+	}
+	return 1;
+}
+
+TSFDEF int tsf_channel_set_steal_priority(tsf* f, int channel, int priority)
+{
+	struct tsf_channel *c = tsf_channel_init(f, channel);
+	if (!c) return 0;
+	if (c->stealPriority == priority) return 1;
+	c->stealPriority = priority;
+	if (f->stealPolicy == TSF_STEAL_CHANNEL_PRIORITY) tsf_voice_heap_rebuild(f);
+	return 1;
+}
+
+TSFDEF int tsf_channel_set_focus(tsf* f, int channel, int flag_focus)
+{
+	struct tsf_channel *c = tsf_channel_init(f, channel);
+	if (!c) return 0;
+	c->focus = (flag_focus ? 1 : 0);
 	return 1;
 }
 
@@ -1943,20 +3949,23 @@ TSFDEF int tsf_channel_note_on(tsf* f, int channel, int key, float vel)
 TSFDEF void tsf_channel_note_off(tsf* f, int channel, int key)
 {
 	unsigned sustain;
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum, *vMatchFirst = TSF_NULL, *vMatchLast = TSF_NULL;
-	for (; v != vEnd; v++)
+	struct tsf_voice *v, *vMatch = TSF_NULL;
+	int i, list;
+	if (!f->channels || channel < 0 || channel >= f->channels->channelNum || key < 0 || key > 127) return;
+	list = (channel + 1) * 128 + key;
+	for (i = f->keyVoices[list]; i; i = v->keyNext)
 	{
-		//Find the first and last entry in the voices list with matching channel, key and look up the smallest play index
-		if (v->playingPreset == -1 || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE || v->heldSustain) continue;
-		else if (!vMatchFirst || v->playIndex < vMatchFirst->playIndex) vMatchFirst = vMatchLast = v;
-		else if (v->playIndex == vMatchFirst->playIndex) vMatchLast = v;
+		//Find the voice with matching channel, key and the smallest play index
+		v = &f->voices[i - 1];
+		if (v->ampenv.segment >= TSF_SEGMENT_RELEASE || v->heldSustain) continue;
+		if (!vMatch || v->playIndex < vMatch->playIndex) vMatch = v;
 	}
-	if (!vMatchFirst) return;
-	for (sustain = f->channels->channels[channel].sustain, v = vMatchFirst; v <= vMatchLast; v++)
+	if (!vMatch) return;
+	for (sustain = f->channels->channels[channel].sustain, i = f->keyVoices[list]; i; i = v->keyNext)
 	{
 		//Stop all voices with matching channel, key and the smallest play index which was enumerated above
-		if (v != vMatchFirst && v != vMatchLast &&
-			(v->playIndex != vMatchFirst->playIndex || v->playingPreset == -1 || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE)) continue;
+		v = &f->voices[i - 1];
+		if (v->playIndex != vMatch->playIndex || v->ampenv.segment >= TSF_SEGMENT_RELEASE || v->heldSustain) continue;
 		//Don't turn off if sustain is active, just mark as held by sustain so we don't forget it
 		if (sustain)
 			v->heldSustain = 1;
@@ -1968,18 +3977,24 @@ TSFDEF void tsf_channel_note_off(tsf* f, int channel, int key)
 TSFDEF void tsf_channel_note_off_all(tsf* f, int channel)
 {
 	//Ignore sustain channel settings, note_off_all overrides
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && v->ampenv.segment < TSF_SEGMENT_RELEASE)
-			tsf_voice_end(f, v);
+	int i, key;
+	struct tsf_voice* v;
+	if (!f->channels || channel < 0 || channel >= f->channels->channelNum) return;
+	for (key = 0; key != 128; key++)
+		for (i = f->keyVoices[(channel + 1) * 128 + key]; i; i = v->keyNext)
+			if ((v = &f->voices[i - 1])->ampenv.segment < TSF_SEGMENT_RELEASE)
+				tsf_voice_end(f, v);
 }
 
 TSFDEF void tsf_channel_sounds_off_all(tsf* f, int channel)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
-			tsf_voice_endquick(f, v);
+	int i, key;
+	struct tsf_voice* v;
+	if (!f->channels || channel < 0 || channel >= f->channels->channelNum) return;
+	for (key = 0; key != 128; key++)
+		for (i = f->keyVoices[(channel + 1) * 128 + key]; i; i = v->keyNext)
+			if ((v = &f->voices[i - 1])->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release)
+				tsf_voice_endquick(f, v);
 }
 
 TSFDEF int tsf_channel_midi_control(tsf* f, int channel, int controller, int control_value)
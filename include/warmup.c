@@ -0,0 +1,114 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "tsf.h"
+
+/* The first note of a preset is late when its sample pages were never
+ * read.  While a question is shown the main thread asks for the presets
+ * and keys of its notes to be warmed up, and a background thread reads
+ * them with tsf_warm_up as the audio callback goes on rendering.
+ * Requests travel through a single producer, single consumer ring like
+ * the note queue, a full ring drops the request.  */
+
+#define WARMUP_QUEUE_SIZE 256 /* must be a power of two */
+
+typedef struct
+{
+  tsf *sf;
+  pthread_t thread;
+  sem_t wake;
+  atomic_bool running;
+  struct tsf_preset_key_set requests[WARMUP_QUEUE_SIZE];
+  _Atomic uint32_t head; /* next request to write, owned by the main thread */
+  _Atomic uint32_t tail; /* next request to read, owned by the warm-up thread */
+  _Atomic uint64_t warmed; /* presets warmed up so far */
+} Warmup;
+
+static void *
+warmup_thread (void *arg)
+{
+  Warmup *warmup = arg;
+  for (;;)
+    {
+      sem_wait (&warmup->wake);
+      if (!atomic_load (&warmup->running))
+        {
+          return NULL;
+        }
+      uint32_t tail
+          = atomic_load_explicit (&warmup->tail, memory_order_relaxed);
+      uint32_t head
+          = atomic_load_explicit (&warmup->head, memory_order_acquire);
+      for (; tail != head; tail++)
+        {
+          int count = tsf_warm_up (
+              warmup->sf, &warmup->requests[tail & (WARMUP_QUEUE_SIZE - 1)],
+              1);
+          atomic_fetch_add_explicit (&warmup->warmed, count,
+                                     memory_order_relaxed);
+        }
+      atomic_store_explicit (&warmup->tail, tail, memory_order_release);
+    }
+}
+
+bool
+warmup_start (Warmup *warmup, tsf *sf)
+{
+  memset (warmup, 0, sizeof (*warmup));
+  warmup->sf = sf;
+  atomic_store (&warmup->running, true);
+  if (sem_init (&warmup->wake, 0, 0) != 0)
+    {
+      return false;
+    }
+  if (pthread_create (&warmup->thread, NULL, warmup_thread, warmup) != 0)
+    {
+      sem_destroy (&warmup->wake);
+      return false;
+    }
+  return true;
+}
+
+void
+warmup_stop (Warmup *warmup)
+{
+  atomic_store (&warmup->running, false);
+  sem_post (&warmup->wake);
+  pthread_join (warmup->thread, NULL);
+  sem_destroy (&warmup->wake);
+}
+
+/* Queue the presets and keys of SETS and wake the thread.  Returns false
+ * when the ring is full, the sets that fit are still warmed up.  */
+bool
+warmup_push (Warmup *warmup, const struct tsf_preset_key_set *sets,
+             int count)
+{
+  uint32_t head = atomic_load_explicit (&warmup->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit (&warmup->tail, memory_order_acquire);
+  int pushed = 0;
+  for (; pushed < count && head - tail != WARMUP_QUEUE_SIZE; pushed++, head++)
+    {
+      warmup->requests[head & (WARMUP_QUEUE_SIZE - 1)] = sets[pushed];
+    }
+  atomic_store_explicit (&warmup->head, head, memory_order_release);
+  sem_post (&warmup->wake);
+  return pushed == count;
+}
+
+/* Queue PRESET of BANK played on the keys LOW to HIGH.  */
+bool
+warmup_push_range (Warmup *warmup, int bank, int preset, int low, int high)
+{
+  struct tsf_preset_key_set set = { 0 };
+  set.bank = bank;
+  set.preset_number = preset;
+  for (int key = low < 0 ? 0 : low; key <= high && key < 128; key++)
+    {
+      set.keys[key >> 5] |= 1u << (key & 31);
+    }
+  return warmup_push (warmup, &set, 1);
+}
@@ -1,22 +1,35 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np for the render pool */
 #include <arena.h>
 #include <defines.h>
 #include <math.h>
+#include <pthread.h>
 #include <raylib.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include <midi.c>
 
 #define TSF_IMPLEMENTATION
 #include "tsf.h"
 
-bool channel[MIDI_CHANNEL][NUMBER_OF_NOTE];
-Sound piano_sound[NUMBER_OF_NOTE];
-Sound bass_sound[NUMBER_OF_NOTE];
-Sound guitar_sound[NUMBER_OF_NOTE];
+#include <rt_check.c>
+#include <audio.c>
+#include <meters.c>
+#include <note_state.c>
+#include <realtime.c>
+#include <render_ahead.c>
+#include <sampler.c>
+#include <snippets.c>
+#include <warmup.c>
+
+static NoteState g_note_state;
+SampledInstrument piano;
+static Meters g_meters;
 ReleaseSound playing_sounds[MAX_PLAYING_SOUND] = { 0 };
 Color CHANNEL_COLOR[16]
     = { YELLOW, PINK,   RAYWHITE, RED,  GREEN, LIME,   DARKGREEN, MAROON,
@@ -29,6 +42,7 @@ draw_midi_grid ()
   float width_spacing = (WINDOW_WIDTH * 0.95) / (float)(NUMBER_OF_NOTE);
   float height = (WINDOW_HEIGHT * 0.95) / (float)(MIDI_CHANNEL + 6);
   float height_spacing = (WINDOW_HEIGHT * 0.95) / (float)(MIDI_CHANNEL);
+  const NoteSnapshot *notes = note_state_read (&g_note_state);
   BeginDrawing ();
   ClearBackground (GRAY);
   for (int y = 0; y < MIDI_CHANNEL; y++)
@@ -41,7 +55,25 @@ draw_midi_grid ()
                   y * height_spacing
                       + ((WINDOW_HEIGHT) - (WINDOW_HEIGHT * 0.95)) / 2,
                   width, height };
-          DrawRectangleRec (rec, channel[y][i] ? CHANNEL_COLOR[y] : BLACK);
+          DrawRectangleRec (rec, note_snapshot_playing (notes, y, i)
+                                     ? CHANNEL_COLOR[y]
+                                     : BLACK);
+        }
+    }
+  if (CHANNEL_METERS)
+    {
+      /* Peak and RMS bars of each channel in the margin left of its row */
+      MeterLevels levels;
+      float margin = ((WINDOW_WIDTH) - (WINDOW_WIDTH * 0.95)) / 2;
+      meters_read (&g_meters, &levels);
+      for (int y = 0; y < MIDI_CHANNEL && y < METER_BUSES; y++)
+        {
+          float top = y * height_spacing
+                      + ((WINDOW_HEIGHT) - (WINDOW_HEIGHT * 0.95)) / 2;
+          DrawRectangle (0, top, margin * meter_fraction (levels.peak[y]),
+                         height, CHANNEL_COLOR[y]);
+          DrawRectangle (0, top, margin * meter_fraction (levels.rms[y]),
+                         height, BLACK);
         }
     }
   DrawFPS (10, 10);
@@ -49,13 +81,139 @@ draw_midi_grid ()
 }
 
 static tsf *g_sf = NULL;
+static NoteQueue g_notes;
+static RenderPool g_render_pool;
+static bool g_render_pool_running = false;
+static Governor g_governor;
+static RenderAhead g_ahead;
+static Realtime g_realtime;
+static Warmup g_warmup;
+static SnippetCache g_snippets;
+static bool g_snippets_running = false;
+
+/* Interpolation while the governor sees enough headroom.  */
+#define PLAYBACK_INTERPOLATION TSF_INTERPOLATION_CUBIC
+
+/* Soundfonts bigger than this are streamed from disk instead of loaded.  */
+#define STREAMING_SOUNDFONT_SIZE ((off_t)512 << 20)
+#define STREAMING_RESIDENT_MS 250
+#define STREAMING_VOICES 64
+#define STREAMING_BUFFER_MS 500
+/* Loaded soundfonts also get copies of their samples decimated by 2 and 4
+   so that high notes alias less.  */
+#define SAMPLE_MIP_LEVELS 2
+/* Lowest note of the intervals played on keys 1 to 9 (middle C).  */
+#define INTERVAL_ROOT 60
+/* MIDI velocity of the interval notes, sampled or not.  */
+#define INTERVAL_VELOCITY 100
+/* With SAMPLED_INSTRUMENTS 2 the interval keys switch to the sampled
+   notes once the governor stayed at this level or above for this long.  */
+#define SAMPLER_GOVERNOR_LEVEL 2
+#define SAMPLER_GOVERNOR_SECONDS 2
+
+static volatile bool g_disk_running = false;
+
+/* Keep the ring buffers of streaming voices filled, sleeping briefly
+ * whenever there is nothing to read.  */
+static void *
+disk_thread (void *arg)
+{
+  tsf *sf = arg;
+  struct timespec idle = { 0, 1000000 };
+  while (g_disk_running)
+    {
+      if (!tsf_disk_service (sf))
+        {
+          nanosleep (&idle, NULL);
+        }
+    }
+  return NULL;
+}
+
+/* Collect the presets and keys the song plays, so only those get loaded
+ * from the soundfont.  Drums (channel 9) use the bank 128 kit.  Returns
+ * the number of entries written to NEEDED (at most 129). */
+static int
+collect_song_presets (struct tsf_preset_key_set *needed)
+{
+  struct tsf_preset_key_set sets[129] = { 0 };
+  bool used[129] = { 0 };
+  int count = 0;
+  MidiEvent *s, *tmp;
+  HASH_ITER (hh, midi.events, s, tmp)
+  {
+    for (u32 index = 0; index < s->size; index++)
+      {
+        EventValue ev = s->event_value[index];
+        if (ev.event_type != BASIC_EVENT || ev.event_id != NOTE_ON)
+          {
+            continue;
+          }
+        int slot = ev.channel == 9 ? 128 : (ev.program & 0x7F);
+        int note = ev.value.note.note & 0x7F;
+        used[slot] = true;
+        sets[slot].keys[note >> 5] |= 1u << (note & 31);
+      }
+  }
+  for (int slot = 0; slot < 129; slot++)
+    {
+      if (!used[slot])
+        {
+          continue;
+        }
+      needed[count] = sets[slot];
+      needed[count].bank = slot == 128 ? 128 : 0;
+      needed[count].preset_number = slot == 128 ? 0 : slot;
+      count++;
+    }
+  return count;
+}
 
 static void
 MyAudioCallback (void *bufferData, unsigned int frames)
 {
   float *out = (float *)bufferData;
+  struct timespec start, end;
 
-  tsf_render_float (g_sf, out, frames, 0);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  RT_CHECK_ENTER ();
+  if (REALTIME_AUDIO)
+    {
+      realtime_audio_thread (&g_realtime);
+    }
+  note_queue_apply (&g_notes, g_sf);
+  if (CHANNEL_METERS)
+    {
+      /* Single threaded, every channel on its own bus.  */
+      meters_render (&g_meters, g_sf, out, frames);
+    }
+  else if (tsf_active_voice_count (g_sf) == 0)
+    {
+      /* While nothing is played interactively the song is a copy away.  */
+      render_ahead_read (&g_ahead, out, frames, 0);
+    }
+  else
+    {
+      if (g_render_pool_running)
+        {
+          render_pool_render (&g_render_pool, out, frames);
+        }
+      else
+        {
+          tsf_render_float (g_sf, out, frames, 0);
+        }
+      render_ahead_read (&g_ahead, out, frames, 1);
+    }
+  if (g_snippets_running)
+    {
+      snippet_cache_mix (&g_snippets, out, frames);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  governor_update (&g_governor,
+                   (end.tv_sec - start.tv_sec)
+                       + (end.tv_nsec - start.tv_nsec) / 1e9,
+                   (double)frames / SAMPLE_RATE);
+  RT_CHECK_LEAVE ();
 }
 
 int
@@ -78,7 +236,56 @@ main ()
   SetConfigFlags (FLAG_WINDOW_HIGHDPI);
   InitWindow (0, 0, "Ear Trainer");
   InitAudioDevice ();
-  g_sf = tsf_load_filename (soundfont_file_path);
+  struct tsf_preset_key_set needed[129];
+  int needed_count = collect_song_presets (needed);
+  /* Keys 1 to 9 play that many semitones up from middle C on the first
+     instrument of the song.  */
+  int interval_preset = 0;
+  for (int i = 0; i < needed_count; i++)
+    {
+      if (needed[i].bank == 0)
+        {
+          interval_preset = needed[i].preset_number;
+          for (int key = INTERVAL_ROOT; key <= INTERVAL_ROOT + 9; key++)
+            {
+              needed[i].keys[key >> 5] |= 1u << (key & 31);
+            }
+          break;
+        }
+    }
+  struct stat soundfont_stat;
+  bool streaming = stat (soundfont_file_path, &soundfont_stat) == 0
+                   && soundfont_stat.st_size > STREAMING_SOUNDFONT_SIZE;
+  if (streaming)
+    {
+      g_sf = tsf_load_filename_streaming (
+          soundfont_file_path, STREAMING_RESIDENT_MS, STREAMING_VOICES,
+          STREAMING_BUFFER_MS);
+    }
+  else
+    {
+      g_sf = tsf_load_filename_subset (soundfont_file_path, needed,
+                                       needed_count);
+      if (g_sf && !tsf_build_mips (g_sf, SAMPLE_MIP_LEVELS))
+        {
+          fprintf (stderr, "Failed to build the decimated samples\n");
+        }
+      if (!g_sf)
+        {
+          /* The subset did not fit in memory: map the whole font and page
+             in only the samples of the presets the song plays.  */
+          g_sf = tsf_load_filename_mapped (soundfont_file_path);
+          for (int i = 0; g_sf && i < needed_count; i++)
+            {
+              int index = tsf_get_presetindex (g_sf, needed[i].bank,
+                                               needed[i].preset_number);
+              if (index >= 0)
+                {
+                  tsf_prefetch_preset (g_sf, index);
+                }
+            }
+        }
+    }
   if (!g_sf)
     {
       fprintf (stderr, "Failed to load soundfont\n");
@@ -86,7 +293,66 @@ main ()
     }
 
   tsf_set_output (g_sf, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+  /* Everything the callback touches is allocated before the stream
+     starts: the voices and their key lists here, the interpolation tables
+     in governor_init and the note queue statically.  Notes are played
+     with tsf_bank_note_on, so tsf never creates channels.  */
   tsf_set_max_voices (g_sf, 128); // pre-allocate voices (good for real-time)
+  governor_init (&g_governor, g_sf, PLAYBACK_INTERPOLATION);
+  /* Lock before the threads that write tsf memory start, memory that
+     cannot be locked is touched by writing it.  */
+  if (REALTIME_AUDIO)
+    {
+      realtime_lock (&g_realtime, g_sf);
+    }
+  /* The copy the song can play ahead on, made while nothing else uses
+     g_sf.  */
+  bool ahead_ready
+      = !CHANNEL_METERS
+        && render_ahead_init (&g_ahead, g_sf, PLAYBACK_INTERPOLATION);
+  if (RENDER_THREADS > 1)
+    {
+      g_render_pool_running
+          = render_pool_start (&g_render_pool, g_sf, RENDER_THREADS);
+    }
+  if (REALTIME_AUDIO)
+    {
+      for (int i = 1; i < g_render_pool.thread_count; i++)
+        {
+          realtime_thread (&g_realtime, g_render_pool.workers[i].thread,
+                           REALTIME_AUDIO_PRIORITY);
+        }
+    }
+  pthread_t disk_io;
+  if (streaming)
+    {
+      g_disk_running = true;
+      if (pthread_create (&disk_io, NULL, disk_thread, g_sf) != 0)
+        {
+          fprintf (stderr, "Failed to start the disk streaming thread\n");
+          return 1;
+        }
+      if (REALTIME_AUDIO)
+        {
+          realtime_thread (&g_realtime, disk_io, REALTIME_FEEDER_PRIORITY);
+        }
+    }
+
+  sampler_init (playing_sounds, MAX_PLAYING_SOUND);
+  bool piano_ready
+      = SAMPLED_INSTRUMENTS
+        && sampled_instrument_render (&piano, g_sf, 0, interval_preset,
+                                      INTERVAL_ROOT, INTERVAL_ROOT + 9,
+                                      INTERVAL_VELOCITY)
+               > 0;
+  if (SAMPLED_INSTRUMENTS && !piano_ready)
+    {
+      fprintf (stderr, "Failed to render the sampled piano\n");
+    }
+  bool sampled = piano_ready && SAMPLED_INSTRUMENTS == 1;
+  int strained_frames = 0; /* frames the governor spent at a low level */
+  g_snippets_running = snippet_cache_start (
+      &g_snippets, g_sf, (size_t)SNIPPET_CACHE_MB << 20);
 
   AudioStream stream = LoadAudioStream (SAMPLE_RATE, 32, CHANNELS);
 
@@ -95,10 +361,20 @@ main ()
 
   PlayAudioStream (stream);
 
+  /* Read the samples of the song while the student gets ready.  */
+  bool warming = warmup_start (&g_warmup, g_sf);
+  if (warming)
+    {
+      warmup_push (&g_warmup, needed, needed_count);
+    }
+
   double current_frame = 0;
   double previous_frame = 0;
   double ticks_per_second = (midi.division * 1000000.0) / midi.tempo;
   bool running = false;
+  bool song_ahead = false; /* the song plays from g_ahead, not g_notes */
+  bool interacted = false;  /* render_ahead_stop was called */
+  note_state_init (&g_note_state);
   int64_t total_frames
       = FPS * 60; // render 10 seconds, or change to your length
 
@@ -112,10 +388,87 @@ main ()
         {
           quit = true;
         }
-      if (IsKeyPressed (KEY_SPACE))
+      /* A machine that keeps the governor at a reduced level plays the
+         intervals from the sampled notes from then on.  */
+      if (piano_ready && !sampled)
+        {
+          strained_frames = atomic_load (&g_governor.counters.level)
+                                    >= SAMPLER_GOVERNOR_LEVEL
+                                ? strained_frames + 1
+                                : 0;
+          sampled = strained_frames >= FPS * SAMPLER_GOVERNOR_SECONDS;
+        }
+      if (IsKeyPressed (KEY_SPACE) && !running)
         {
           running = true;
+          /* The student answers with the interval keys from now on, read
+             their samples again in case the song pushed them out.  */
+          if (warming)
+            {
+              warmup_push_range (&g_warmup, 0, interval_preset, INTERVAL_ROOT,
+                                 INTERVAL_ROOT + 9);
+            }
+          song_ahead = ahead_ready
+                       && render_ahead_start (&g_ahead, midi.events,
+                                              midi.division, midi.tempo);
+          if (song_ahead && REALTIME_AUDIO)
+            {
+              realtime_thread (&g_realtime, g_ahead.thread,
+                               REALTIME_FEEDER_PRIORITY);
+            }
+        }
+      /* Any other key is the student interacting.  */
+      for (int key = GetKeyPressed (); key != 0; key = GetKeyPressed ())
+        {
+          if (key != KEY_SPACE && key != KEY_ENTER && song_ahead
+              && !interacted)
+            {
+              /* The callback renders the rest of the song, under the
+                 governor like g_sf.  */
+              interacted = true;
+              render_ahead_stop (&g_ahead);
+              governor_follow (&g_governor, g_ahead.sf);
+            }
+          if (key >= KEY_ONE && key <= KEY_NINE && sampled)
+            {
+              sampler_note_on (playing_sounds, MAX_PLAYING_SOUND, &piano,
+                               INTERVAL_ROOT);
+              sampler_note_on (playing_sounds, MAX_PLAYING_SOUND, &piano,
+                               INTERVAL_ROOT + key - KEY_ZERO);
+            }
+          else if (key >= KEY_ONE && key <= KEY_NINE && g_snippets_running)
+            {
+              uint8_t notes[2]
+                  = { INTERVAL_ROOT, INTERVAL_ROOT + key - KEY_ZERO };
+              uint8_t velocities[2]
+                  = { INTERVAL_VELOCITY, INTERVAL_VELOCITY };
+              SnippetKey interval = snippet_key (0, interval_preset, notes,
+                                                 velocities, 2, 100, 4, 4);
+              snippet_play (&g_snippets, &interval);
+            }
         }
+      if (sampled)
+        {
+          /* Sampled notes sound while their key is held, the root until
+             the last interval key is let go.  */
+          bool held = false;
+          for (int key = KEY_ONE; key <= KEY_NINE; key++)
+            {
+              if (IsKeyReleased (key))
+                {
+                  sampler_note_off (playing_sounds, MAX_PLAYING_SOUND, &piano,
+                                    INTERVAL_ROOT + key - KEY_ZERO);
+                }
+              held = held || IsKeyDown (key);
+            }
+          if (!held)
+            {
+              sampler_note_off (playing_sounds, MAX_PLAYING_SOUND, &piano,
+                                INTERVAL_ROOT);
+            }
+        }
+      /* Note offs that found the queue full go out first.  */
+      note_queue_flush (&g_notes);
       if (running)
         {
           previous_frame = current_frame;
@@ -141,14 +494,11 @@ main ()
                       {
                         int note = ev.value.note.note;
                         u8 program = ev.program;
-                        channel[ev.channel][note] = false;
-                        if (ev.channel == 9)
-                          {
-                            tsf_bank_note_off (g_sf, 128, 0, note);
-                          }
-                        else
+                        note_state_off (&g_note_state, ev.channel, note);
+                        if (!song_ahead)
                           {
-                            tsf_note_off (g_sf, program, note);
+                            note_queue_note_off (&g_notes, ev.channel,
+                                                 program, note);
                           }
                       }
                       break;
@@ -156,22 +506,24 @@ main ()
                       {
                         int note = ev.value.note.note;
                         float velocity
-                            = (float)ev.value.note.velocity / (float)128;
+                            = MIDI_VELOCITY (ev.value.note.velocity);
                         u8 program = ev.program;
-                        channel[ev.channel][note] = true;
                         if (velocity == 0)
                           {
-                            channel[ev.channel][note] = false;
-                            tsf_note_off (g_sf, 0, note);
+                            note_state_off (&g_note_state, ev.channel, note);
+                            if (!song_ahead)
+                              {
+                                note_queue_note_off (&g_notes, ev.channel,
+                                                     program, note);
+                              }
                             break;
                           }
-                        if (ev.channel == 9)
+                        note_state_on (&g_note_state, ev.channel, note,
+                                       ev.value.note.velocity, tick);
+                        if (!song_ahead)
                           {
-                            tsf_bank_note_on (g_sf, 128, 0, note, velocity);
-                          }
-                        else
-                          {
-                            tsf_note_on (g_sf, program, note, velocity);
+                            note_queue_note_on (&g_notes, ev.channel,
+                                                program, note, velocity);
                           }
                       }
                       break;
@@ -182,9 +534,51 @@ main ()
                     }
                 }
             }
+          note_state_publish (&g_note_state);
+        }
+      if (g_snippets_running)
+        {
+          snippet_cache_update (&g_snippets);
+        }
+      if (piano_ready)
+        {
+          sampler_update (playing_sounds, MAX_PLAYING_SOUND, GetFrameTime ());
         }
       draw_midi_grid ();
     }
 
+  StopAudioStream (stream);
+  sampler_stop_all (playing_sounds, MAX_PLAYING_SOUND);
+  sampled_instrument_unload (&piano);
+  if (warming)
+    {
+      warmup_stop (&g_warmup);
+    }
+  if (g_snippets_running)
+    {
+      snippet_cache_print (&g_snippets, stdout);
+      snippet_cache_stop (&g_snippets);
+    }
+  governor_follow (&g_governor, NULL);
+  render_ahead_close (&g_ahead);
+  if (g_render_pool_running)
+    {
+      g_render_pool_running = false;
+      render_pool_stop (&g_render_pool);
+    }
+  if (streaming)
+    {
+      g_disk_running = false;
+      pthread_join (disk_io, NULL);
+    }
+  governor_print (&g_governor, stdout);
+  if (song_ahead)
+    {
+      render_ahead_print (&g_ahead, stdout);
+    }
+  if (REALTIME_AUDIO)
+    {
+      realtime_print (&g_realtime, stdout);
+    }
   return 0;
 }